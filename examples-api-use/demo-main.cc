@@ -7,6 +7,7 @@
 // This is a grab-bag of various demos and not very readable.
 #include "led-matrix.h"
 #include "threaded-canvas-manipulator.h"
+#include "animator.h"
 #include "pixel-mapper.h"
 #include "graphics.h"
 
@@ -36,44 +37,34 @@ static void InterruptHandler(int signo) {
 }
 
 /*
- * The following are demo image generators. They all use the utility
- * class ThreadedCanvasManipulator to generate new frames.
+ * The following are demo image generators. They use the utility
+ * class ThreadedCanvasManipulator to generate new frames, or Animator, which
+ * renders complete frames off-screen and swaps them in on vsync.
  */
 
 // Simple generator that pulses through RGB and White.
-class ColorPulseGenerator : public ThreadedCanvasManipulator {
+class ColorPulseGenerator : public Animator {
 public:
-  ColorPulseGenerator(RGBMatrix *m) : ThreadedCanvasManipulator(m), matrix_(m) {
-    off_screen_canvas_ = m->CreateFrameCanvas();
-  }
-  void Run() {
-    uint32_t continuum = 0;
-    while (running() && !interrupt_received) {
-      usleep(5 * 1000);
-      continuum += 1;
-      continuum %= 3 * 255;
-      int r = 0, g = 0, b = 0;
-      if (continuum <= 255) {
-        int c = continuum;
-        b = 255 - c;
-        r = c;
-      } else if (continuum > 255 && continuum <= 511) {
-        int c = continuum - 256;
-        r = 255 - c;
-        g = c;
-      } else {
-        int c = continuum - 512;
-        g = 255 - c;
-        b = c;
-      }
-      off_screen_canvas_->Fill(r, g, b);
-      off_screen_canvas_ = matrix_->SwapOnVSync(off_screen_canvas_);
+  ColorPulseGenerator(RGBMatrix *m) : Animator(m) {}
+  void Render(FrameCanvas *canvas, uint64_t frame_time_us) {
+    // One step every 5ms.
+    const uint32_t continuum = (frame_time_us / 5000) % (3 * 255);
+    int r = 0, g = 0, b = 0;
+    if (continuum <= 255) {
+      int c = continuum;
+      b = 255 - c;
+      r = c;
+    } else if (continuum > 255 && continuum <= 511) {
+      int c = continuum - 256;
+      r = 255 - c;
+      g = c;
+    } else {
+      int c = continuum - 512;
+      g = 255 - c;
+      b = c;
     }
+    canvas->Fill(r, g, b);
   }
-
-private:
-  RGBMatrix *const matrix_;
-  FrameCanvas *off_screen_canvas_;
 };
 
 // Simple generator that pulses through brightness on red, green, blue and white
@@ -156,9 +147,9 @@ public:
 };
 
 // Simple class that generates a rotating block on the screen.
-class RotatingBlockGenerator : public ThreadedCanvasManipulator {
+class RotatingBlockGenerator : public Animator {
 public:
-  RotatingBlockGenerator(Canvas *m) : ThreadedCanvasManipulator(m) {}
+  RotatingBlockGenerator(RGBMatrix *m) : Animator(m, 60) {}
 
   uint8_t scale_col(int val, int lo, int hi) {
     if (val < lo) return 0;
@@ -166,43 +157,38 @@ public:
     return 255 * (val - lo) / (hi - lo);
   }
 
-  void Run() {
-    const int cent_x = canvas()->width() / 2;
-    const int cent_y = canvas()->height() / 2;
+  void Render(FrameCanvas *canvas, uint64_t frame_time_us) {
+    const int cent_x = canvas->width() / 2;
+    const int cent_y = canvas->height() / 2;
 
     // The square to rotate (inner square + black frame) needs to cover the
     // whole area, even if diagnoal. Thus, when rotating, the outer pixels from
     // the previous frame are cleared.
-    const int rotate_square = min(canvas()->width(), canvas()->height()) * 1.41;
+    const int rotate_square = min(canvas->width(), canvas->height()) * 1.41;
     const int min_rotate = cent_x - rotate_square / 2;
     const int max_rotate = cent_x + rotate_square / 2;
 
     // The square to display is within the visible area.
-    const int display_square = min(canvas()->width(), canvas()->height()) * 0.7;
+    const int display_square = min(canvas->width(), canvas->height()) * 0.7;
     const int min_display = cent_x - display_square / 2;
     const int max_display = cent_x + display_square / 2;
 
     const float deg_to_rad = 2 * 3.14159265 / 360;
-    int rotation = 0;
-    while (running() && !interrupt_received) {
-      ++rotation;
-      usleep(15 * 1000);
-      rotation %= 360;
-      for (int x = min_rotate; x < max_rotate; ++x) {
-        for (int y = min_rotate; y < max_rotate; ++y) {
-          float rot_x, rot_y;
-          Rotate(x - cent_x, y - cent_x,
-                 deg_to_rad * rotation, &rot_x, &rot_y);
-          if (x >= min_display && x < max_display &&
-              y >= min_display && y < max_display) { // within display square
-            canvas()->SetPixel(rot_x + cent_x, rot_y + cent_y,
-                               scale_col(x, min_display, max_display),
-                               255 - scale_col(y, min_display, max_display),
-                               scale_col(y, min_display, max_display));
-          } else {
-            // black frame.
-            canvas()->SetPixel(rot_x + cent_x, rot_y + cent_y, 0, 0, 0);
-          }
+    const int rotation = (frame_time_us / 15000) % 360;  // 1 degree per 15ms.
+    for (int x = min_rotate; x < max_rotate; ++x) {
+      for (int y = min_rotate; y < max_rotate; ++y) {
+        float rot_x, rot_y;
+        Rotate(x - cent_x, y - cent_x,
+               deg_to_rad * rotation, &rot_x, &rot_y);
+        if (x >= min_display && x < max_display &&
+            y >= min_display && y < max_display) { // within display square
+          canvas->SetPixel(rot_x + cent_x, rot_y + cent_y,
+                           scale_col(x, min_display, max_display),
+                           255 - scale_col(y, min_display, max_display),
+                           scale_col(y, min_display, max_display));
+        } else {
+          // black frame.
+          canvas->SetPixel(rot_x + cent_x, rot_y + cent_y, 0, 0, 0);
         }
       }
     }
@@ -1149,9 +1135,10 @@ int main(int argc, char *argv[]) {
   // The ThreadedCanvasManipulator objects are filling
   // the matrix continuously.
   ThreadedCanvasManipulator *image_gen = NULL;
+  Animator *animator = NULL;   // If image_gen is one.
   switch (demo) {
   case 0:
-    image_gen = new RotatingBlockGenerator(canvas);
+    image_gen = animator = new RotatingBlockGenerator(matrix);
     break;
 
   case 1:
@@ -1174,7 +1161,7 @@ int main(int argc, char *argv[]) {
     break;
 
   case 4:
-    image_gen = new ColorPulseGenerator(matrix);
+    image_gen = animator = new ColorPulseGenerator(matrix);
     break;
 
   case 5:
@@ -1231,7 +1218,20 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  // Stop image generating thread. The delete triggers
+  // Stop image generating thread. Stop it before the delete, as the
+  // Animators don't stop in their destructors.
+  image_gen->Stop();
+  image_gen->WaitStopped();
+
+  if (animator) {
+    const Animator::Stats stats = animator->GetStats();
+    printf("%llu frames rendered in %uus (max %uus) of %uus budget, "
+           "%llu overruns.\n",
+           (unsigned long long) stats.frames, stats.render_us_avg,
+           stats.render_us_max, stats.budget_us,
+           (unsigned long long) stats.overruns);
+  }
+
   delete image_gen;
   delete canvas;
 
@@ -0,0 +1,97 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_ANIMATOR_H
+#define RPI_ANIMATOR_H
+
+#include <stdint.h>
+
+#include "led-matrix.h"
+#include "threaded-canvas-manipulator.h"
+
+namespace rgb_matrix {
+//
+// Like ThreadedCanvasManipulator, but instead of drawing into the visible
+// canvas whenever it likes (which tears), the Animator asks for one complete
+// frame at a time on an off-screen FrameCanvas, which is then swapped in on
+// vsync. It also keeps track of how long rendering takes compared to the
+// time available per frame.
+//
+// Extend it, then implement Render(). Example:
+/*
+  class MyCrazyDemo : public Animator {
+  public:
+    MyCrazyDemo(RGBMatrix *m) : Animator(m, 60), step_(10000) {}  // 60fps
+    virtual ~MyCrazyDemo() {
+      Stop();
+      WaitStopped();   // Render() uses step_, so stop before it is gone.
+    }
+    virtual void Render(FrameCanvas *canvas, uint64_t frame_time_us) {
+      const uint8_t c = frame_time_us / step_;  // Brighter every 10ms.
+      canvas->Fill(c, c, c);
+    }
+  private:
+    const int step_;
+  };
+
+  MyCrazyDemo *demo = new MyCrazyDemo(matrix);
+  demo->Start();   // Start doing things.
+  // ... do other things, or wait.
+  delete demo;     // Stops it.
+*/
+class Animator : public ThreadedCanvasManipulator {
+public:
+  // Animate on "matrix" with "frame_rate" frames per second (see
+  // RGBMatrix::SetContentFrameRate()). With 0, a new frame is rendered for
+  // every refresh cycle.
+  Animator(RGBMatrix *matrix, double frame_rate = 0);
+
+  // Stops the thread and waits until it is done. When this runs, the
+  // subclass is already destroyed, but the thread might still be in
+  // Render(). So subclasses need to call Stop() and WaitStopped() in their
+  // own destructor as well; or call them before the delete.
+  virtual ~Animator();
+
+  // Implement this: draw the complete frame into "canvas". It contains some
+  // earlier frame, not necessarily the previous one. "frame_time_us" is the
+  // time the frame is going to be shown, in microseconds since Start(); base
+  // the animation on it to keep its speed independent of the frame rate.
+  virtual void Render(FrameCanvas *canvas, uint64_t frame_time_us) = 0;
+
+  struct Stats {
+    uint64_t frames;         // Frames rendered.
+    uint32_t budget_us;      // Time per frame available for rendering.
+    uint32_t render_us_avg;  // Time Render() took, average over recent
+    uint32_t render_us_max;  // frames and maximum.
+    uint64_t overruns;       // Frames that took longer than the budget.
+  };
+  // Can be called from any thread.
+  Stats GetStats();
+
+protected:
+  RGBMatrix *matrix() { return matrix_; }
+
+private:
+  virtual void Run();
+  void RecordFrame(uint32_t render_us, uint32_t budget_us);
+
+  RGBMatrix *const matrix_;
+  const double frame_rate_;
+  Mutex stats_mutex_;
+  Stats stats_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_ANIMATOR_H
@@ -0,0 +1,46 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http: *gnu.org/licenses/gpl-2.0.txt>
+ */
+#ifndef RPI_GPIO_BITS_H
+#define RPI_GPIO_BITS_H
+
+#include <stdint.h>
+
+/* Written by lib/Makefile: the options the library was compiled with. */
+#include "gpio-config.h"
+
+/*
+ * The type holding one bit per GPIO pin. The regular 40 pin header only
+ * exposes GPIO 0..27, so 32 bits are enough and that is what we use by
+ * default. The Compute Module also exposes GPIO 28..45, which allows for up
+ * to six parallel chains; compile the library with
+ * -DENABLE_WIDE_GPIO_COMPUTE_MODULE to use them (see lib/Makefile).
+ *
+ * As this changes the GPIO class, programs using the library must see the
+ * same setting; so it is taken from gpio-config.h, not from their flags.
+ */
+#if RGB_MATRIX_WIDE_GPIO
+#  ifndef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+#    define ENABLE_WIDE_GPIO_COMPUTE_MODULE
+#  endif
+typedef uint64_t gpio_bits_t;
+#else
+#  ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+#    error "The library was compiled without ENABLE_WIDE_GPIO_COMPUTE_MODULE"
+#  endif
+typedef uint32_t gpio_bits_t;
+#endif
+
+#endif
@@ -20,6 +20,8 @@
 
 #include <vector>
 
+#include "gpio-bits.h"
+
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
@@ -27,7 +29,18 @@ namespace rgb_matrix {
 class GPIO {
  public:
   // Available bits that actually have pins.
-  static const uint32_t kValidBits;
+  static const gpio_bits_t kValidBits;
+
+  // Timing requirements of the panel signals in nanoseconds, as alternative
+  // to the uniform slowdown that slows down every write.
+  struct Timing {
+    Timing() : data_setup_ns(0), data_hold_ns(0), clock_high_ns(0),
+               strobe_ns(0) {}
+    int data_setup_ns;   // Color data stable before rising clock edge.
+    int data_hold_ns;    // Color data stable after rising clock edge.
+    int clock_high_ns;   // Time the clock stays high.
+    int strobe_ns;       // Length of strobe pulse.
+  };
 
   GPIO();
 
@@ -41,41 +54,115 @@ class GPIO {
 #endif
             );
 
-  // Initialize outputs.
-  // Returns the bits that are actually set.
-  uint32_t InitOutputs(uint32_t outputs, bool adafruit_hack_needed = false);
+  // Use the given per-signal timing instead of the uniform slowdown. This
+  // measures how long a write to the GPIO registers takes and derives the
+  // number of writes needed to keep each signal for the requested time. So
+  // only the signals that need it are slowed down.
+  // All other writes, e.g. of the row address, keep the slowdown of Init().
+  // Needs to be called after Init().
+  void SetTiming(const Timing &timing);
+
+  // Nanoseconds a single GPIO write takes; measured in SetTiming().
+  int write_nanos() const { return write_nanos_; }
+
+  // Initialize outputs. Can be called several times, e.g. by several
+  // matrices sharing this GPIO on different pins: each call configures
+  // "outputs" as outputs in addition to the ones before, and Write() then
+  // writes all of them. Nothing is ever switched back to input.
+  // Returns the bits of "outputs" that are actually set.
+  gpio_bits_t InitOutputs(gpio_bits_t outputs,
+                          bool adafruit_hack_needed = false);
 
   // Set the bits that are '1' in the output. Leave the rest untouched.
-  inline void SetBits(uint32_t value) {
+  inline void SetBits(gpio_bits_t value) {
     if (!value) return;
-    *gpio_set_bits_ = value;
-    for (int i = 0; i < slowdown_; ++i) {
-      *gpio_set_bits_ = value;
-    }
+    WriteRepeated(gpio_set_bits_, value, slowdown_);
   }
 
   // Clear the bits that are '1' in the output. Leave the rest untouched.
-  inline void ClearBits(uint32_t value) {
+  inline void ClearBits(gpio_bits_t value) {
     if (!value) return;
-    *gpio_clr_bits_ = value;
-    for (int i = 0; i < slowdown_; ++i) {
-      *gpio_clr_bits_ = value;
-    }
+    WriteRepeated(gpio_clr_bits_, value, slowdown_);
   }
 
   // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
-  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+  inline void WriteMaskedBits(gpio_bits_t value, gpio_bits_t mask) {
     // Writing a word is two operations. The IO is actually pretty slow, so
     // this should probably  be unnoticable.
     ClearBits(~value & mask);
     SetBits(value & mask);
   }
 
-  inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
+  inline void Write(gpio_bits_t value) { WriteMaskedBits(value, output_bits_); }
+
+  // Write data bits of "value" in "mask" (which includes the "clock", so it
+  // goes low), then raise the "clock" to clock in the data.
+  inline void ClockInData(gpio_bits_t value, gpio_bits_t mask,
+                          gpio_bits_t clock) {
+    const gpio_bits_t set_bits = value & mask;
+    if (set_bits) {
+      WriteRepeated(gpio_clr_bits_, ~value & mask, slowdown_);
+      WriteRepeated(gpio_set_bits_, set_bits, data_setup_writes_);
+    } else {
+      WriteRepeated(gpio_clr_bits_, ~value & mask,
+                    data_setup_writes_ > slowdown_
+                    ? data_setup_writes_ : slowdown_);
+    }
+    WriteRepeated(gpio_set_bits_, clock, clock_high_writes_);
+  }
+
+  // Same as ClockInData(), but with the number of repeated writes known at
+  // compile time, so that the write loops disappear. Only valid if
+  // uniform_slowdown() == kSlowdown.
+  template <int kSlowdown>
+  inline void ClockInDataFixed(gpio_bits_t value, gpio_bits_t mask,
+                               gpio_bits_t clock) {
+    WriteRepeated(gpio_clr_bits_, ~value & mask, kSlowdown);
+    const gpio_bits_t set_bits = value & mask;
+    if (set_bits) WriteRepeated(gpio_set_bits_, set_bits, kSlowdown);
+    WriteRepeated(gpio_set_bits_, clock, kSlowdown);
+  }
+
+  // The slowdown if all signals use the same (i.e. SetTiming() changed
+  // nothing), -1 otherwise.
+  int uniform_slowdown() const {
+    return (data_setup_writes_ == slowdown_ && clock_high_writes_ == slowdown_
+            && strobe_writes_ == slowdown_) ? slowdown_ : -1;
+  }
+
+  // Send a positive pulse on the strobe line.
+  inline void Strobe(gpio_bits_t strobe) {
+    WriteRepeated(gpio_set_bits_, strobe, strobe_writes_);
+    WriteRepeated(gpio_clr_bits_, strobe, slowdown_);
+  }
 
  private:
-  uint32_t output_bits_;
+  // Write the value to the register, then repeat that "repeat" times to
+  // keep the signal for longer.
+  // With wide GPIO, the bits 32 and up go to the next register, which is
+  // the corresponding register of the second GPIO bank.
+  inline void WriteRepeated(volatile uint32_t *reg, gpio_bits_t value,
+                            int repeat) {
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+    const uint32_t high = value >> 32;
+    for (int i = 0; i <= repeat; ++i) {
+      *reg = (uint32_t) value;
+      if (high) *(reg + 1) = high;
+    }
+#else
+    *reg = value;
+    for (int i = 0; i < repeat; ++i) {
+      *reg = value;
+    }
+#endif
+  }
+
+  gpio_bits_t output_bits_;
   int slowdown_;
+  int data_setup_writes_;
+  int clock_high_writes_;
+  int strobe_writes_;
+  int write_nanos_;
   volatile uint32_t *gpio_port_;
   volatile uint32_t *gpio_set_bits_;
   volatile uint32_t *gpio_clr_bits_;
@@ -91,10 +178,11 @@ public:
   //   need negative pulses, this is what it does)
   // "nano_wait_spec" contains a list of time periods we'd like
   //   invoke later. This can be used to pre-process timings if needed.
-  static PinPulser *Create(GPIO *io, uint32_t gpio_mask,
+  static PinPulser *Create(GPIO *io, gpio_bits_t gpio_mask,
                            bool allow_hardware_pulsing,
                            const std::vector<int> &nano_wait_spec);
 
+  PinPulser() : last_pulse_late_(false), pulse_scale_(kFullPulseScale) {}
   virtual ~PinPulser() {}
 
   // Send a pulse with a given length (index into nano_wait_spec array).
@@ -102,6 +190,42 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Make the following pulses "scale" / kFullPulseScale of their length in
+  // nano_wait_spec. Shortening all pulses of a refresh cycle by the same
+  // factor as the cycle itself keeps their brightness.
+  static const int kFullPulseScale = 256;
+  void SetPulseScale(int scale) { pulse_scale_ = scale; }
+
+  // True if the OS woke us up too late for the last pulse: with software
+  // pulsing it was longer than requested, with hardware pulsing the next
+  // one is delayed. Valid after WaitPulseFinished().
+  bool last_pulse_late() const { return last_pulse_late_; }
+
+  // Pulsers sleep for longer pulses and busy-wait the remaining time, as
+  // the OS wakes us up late now and then. How late is recorded in a histogram
+  // per time spec with one bucket per microsecond; the last bucket also
+  // counts everything larger.
+  static const int kOvershootBuckets = 256;
+
+  // Copy the overshoot histogram of "time_spec_number" to "histogram",
+  // which needs to have room for kOvershootBuckets values. Can be called
+  // any time from any thread. Returns false if there is no such time spec.
+  static bool GetOvershootHistogram(int time_spec_number,
+                                    uint64_t *histogram);
+
+  // Microseconds before a deadline we stop sleeping and busy-wait instead.
+  // Starts with an empirical value and is adapted from the overshoot
+  // measurements while running.
+  static int JitterAllowanceMicroseconds();
+
+protected:
+  long ScaledLength(long length) const {
+    return length * pulse_scale_ / kFullPulseScale;
+  }
+
+  bool last_pulse_late_;
+  int pulse_scale_;
 };
 
 }  // end namespace rgb_matrix
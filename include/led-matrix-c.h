@@ -96,6 +96,7 @@ struct RGBLedMatrixOptions {
   int pwm_lsb_nanoseconds;
 
   /* The lower bits can be time-dithered for higher refresh rate.
+   * Range 0 .. pwm_bits - 1.
    * Corresponding flag: --led-pwm-dither-bits
    */
   int pwm_dither_bits;
@@ -105,7 +106,8 @@ struct RGBLedMatrixOptions {
    */
   int brightness;
 
-  /* Scan mode: 0=progressive, 1=interlaced
+  /* Scan mode: 0=progressive, 1=interlaced, 2=bit-reversed,
+   * 3=four-way interleave.
    * Corresponding flag: --led-scan-mode
    */
   int scan_mode;
@@ -141,6 +143,59 @@ struct RGBLedMatrixOptions {
   unsigned show_refresh_rate:1;  /* Corresponding flag: --led-show-refresh    */
   // unsigned swap_green_blue:1; /* deprecated, use led_sequence instead */
   unsigned inverse_colors:1;     /* Corresponding flag: --led-inverse         */
+  unsigned adaptive_pwm:1;       /* Corresponding flag: --led-adaptive-pwm    */
+  unsigned suspend_when_black:1; /* Corresponding flag: --led-suspend-black   */
+
+  /* Fixed time per refresh cycle in microseconds; negative to auto-tune.
+   * Corresponding flag: --led-frame-period
+   */
+  int frame_period_us;
+
+  /* Custom scan order as comma separated list of double rows; overrides
+   * scan_mode if set.
+   * Corresponding flag: --led-scan-mode=<list>
+   */
+  const char *scan_order;
+
+  /* Split long bitplanes into this many slices (power of two); 1 = off.
+   * Corresponding flag: --led-pwm-slices
+   */
+  int pwm_slices;
+
+  /* How dithered bitplanes are spread across frames: 0 = balanced,
+   * 1 = contiguous.
+   * Corresponding flag: --led-pwm-dither
+   */
+  int pwm_dither_policy;
+
+  /* Maximum refresh rate while content is static; 0 = off.
+   * Corresponding flag: --led-idle-refresh
+   */
+  int idle_refresh_hz;
+
+  /* If set, refresh statistics are written to this file every second.
+   * Corresponding flag: --led-refresh-stats-file
+   */
+  const char *refresh_stats_file;
+
+  /* CPU of the refresh thread; 0 or -1 = the last CPU. CPU 0 itself can
+   * only be chosen with the flag.
+   * Corresponding flag: --led-refresh-cpu
+   */
+  int refresh_cpu;
+
+  /* Real-time priority of the refresh thread, 1..99; 0 = default (99).
+   * Corresponding flag: --led-refresh-priority
+   */
+  int refresh_priority;
+
+  unsigned lock_memory:1;      /* Corresponding flag: --led-lock-memory     */
+  unsigned check_isolation:1;  /* Corresponding flag: --led-check-isolation */
+
+  /* Directory to cache the calculated pixel mapping in; NULL = none.
+   * Corresponding flag: --led-mapping-cache
+   */
+  const char *mapping_cache_dir;
 };
 
 /**
@@ -230,6 +285,17 @@ void led_canvas_clear(struct LedCanvas *canvas);
 /** Fill matrix with given color. */
 void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b);
 
+/**
+ * Faster than setting the pixels of a rectangle one by one: fill it with a
+ * color, or copy "rgb" into it: width * height pixels of three bytes
+ * (red, green, blue) each, row by row. Parts outside the canvas are left out.
+ */
+void led_canvas_fill_rect(struct LedCanvas *canvas, int x, int y,
+                          int width, int height,
+                          uint8_t r, uint8_t g, uint8_t b);
+void led_canvas_set_pixels(struct LedCanvas *canvas, int x, int y,
+                           int width, int height, const uint8_t *rgb);
+
 /*** API to provide double-buffering. ***/
 
 /**
@@ -253,6 +319,76 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Pace led_matrix_swap_on_vsync() to content of the given frames per second,
+ * even if that is not an integer fraction of the refresh rate. 0 = off.
+ */
+void led_matrix_set_content_frame_rate(struct RGBLedMatrix *matrix,
+                                       double fps);
+
+/**
+ * Triple-buffering: publish the given canvas to be shown with the next
+ * refresh cycle without waiting. Returns a canvas that is not in use anymore
+ * to draw the next frame on; it contains some older frame, so redraw it
+ * completely.
+ *
+ *   struct LedCanvas *offscreen = led_matrix_create_offscreen_canvas(...);
+ *   for (;;) {
+ *     draw(offscreen);
+ *     offscreen = led_matrix_submit_frame(matrix, offscreen);
+ *   }
+ *
+ * Don't mix with led_matrix_swap_on_vsync().
+ */
+struct LedCanvas *led_matrix_submit_frame(struct RGBLedMatrix *matrix,
+                                          struct LedCanvas *canvas);
+
+/**
+ * File descriptor for poll()/epoll() that becomes readable at every refresh
+ * boundary and when a submitted frame went live. Read an uint64_t from it to
+ * reset it. Owned by the matrix, don't close. -1 if refresh is not running.
+ */
+int led_matrix_get_vsync_fd(struct RGBLedMatrix *matrix);
+
+/**
+ * Sleep until shortly before the next refresh boundary, so that a frame drawn
+ * right after and handed over with led_matrix_submit_frame() is shown there
+ * with the freshest data. The lead time adapts to the measured render time,
+ * plus margin_us. Returns the predicted microseconds until the boundary.
+ */
+int led_matrix_wait_until_render_time(struct RGBLedMatrix *matrix,
+                                      int margin_us);
+
+/**
+ * Statistics of the refresh thread since start; all times in microseconds.
+ * See RGBMatrix::RefreshStats in led-matrix.h for details.
+ */
+struct LedRefreshStats {
+  uint64_t frames;
+  uint32_t frame_us_p50;
+  uint32_t frame_us_p99;
+  uint32_t frame_us_p999;
+  uint32_t frame_us_max;
+  uint32_t work_us_max;
+  uint64_t frame_overruns;
+  uint64_t late_wakeups;
+  uint32_t swap_latency_us_p99;
+  uint32_t swap_latency_us_max;
+  uint32_t photon_latency_us_p50;  /* Hand-over until all pixels were lit. */
+  uint32_t photon_latency_us_p99;
+  uint32_t photon_latency_us_max;
+  uint64_t dropped_frames;
+  uint32_t planes_shown;           /* Bitplanes of the last refresh cycle. */
+  uint64_t late_pulses[16];        /* late_wakeups per bitplane. */
+};
+
+/**
+ * Fill "stats". Safe to call any time from any thread. Returns 0 if the
+ * refresh thread is not running.
+ */
+int led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                 struct LedRefreshStats *stats);
+
 
 struct LedFont *load_font(const char *bdf_font_file);
 void delete_font(struct LedFont *font);
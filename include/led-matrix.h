@@ -32,12 +32,37 @@
 namespace rgb_matrix {
 class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
+struct RuntimeOptions;
 
 namespace internal {
 class Framebuffer;
+class PanelHardware;
 class PixelDesignatorMap;
+class RefreshStatsCollector;
+class RefreshStatsReporter;
 }
 
+// How the refresh thread is set up to get the CPU whenever it needs it.
+// Part of RGBMatrix::Options.
+struct RealtimeOptions {
+  RealtimeOptions();   // Creates defaults.
+
+  // The CPU the refresh thread is bound to. -1 = the last one, which is
+  // what you typically keep free with isolcpus= on the kernel command line.
+  int cpu;            // Flag: --led-refresh-cpu
+
+  // SCHED_FIFO priority of the refresh thread, 1..99. 0 = not real-time.
+  int priority;       // Flag: --led-refresh-priority
+
+  // Lock all memory into RAM and touch the stack and some heap up front, so
+  // that the refresh thread never has to wait for a page fault.
+  bool lock_memory;   // Flag: --led-lock-memory
+
+  // On start, print if the refresh CPU is isolated from the scheduler
+  // and timer ticks and if interrupts or other tasks still run on it.
+  bool check_isolation;  // Flag: --led-check-isolation
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 //
@@ -104,18 +129,40 @@ public:
     int pwm_lsb_nanoseconds;
 
     // The lower bits can be time-dithered for higher refresh rate.
+    // Range 0 .. pwm_bits - 1.
     // Flag: --led-pwm-dither-bits
     int pwm_dither_bits;
 
+    // How the dithered bitplanes are distributed across frames.
+    // Balanced keeps all frames the same duration, contiguous is how
+    // dithering used to work.
+    enum DitherPolicy { kDitherBalanced = 0, kDitherContiguous = 1 };
+    // Flag: --led-pwm-dither=<balanced|contiguous>
+    int pwm_dither_policy;
+
+    // Split the long pulses of the high bitplanes into this many slices
+    // (a power of two), interleaved with other rows. This keeps each LED lit
+    // for the same time, but in shorter bursts, for less visible flicker.
+    // 1 = no slicing.
+    // Flag: --led-pwm-slices
+    int pwm_slices;
+
     // The initial brightness of the panel in percent. Valid range is 1..100
     // Default: 100
     // Flag: --led-brightness
     int brightness;
 
-    // Scan mode: 0=progressive, 1=interlaced
+    // Scan mode: 0=progressive, 1=interlaced, 2=bit-reversed,
+    // 3=four-way interleave.
     // Flag: --led-scan-mode
     int scan_mode;
 
+    // Custom order in which the rows are scanned, as comma separated list of
+    // double rows (0 .. rows/2 - 1), each exactly once. Overrides scan_mode
+    // if set.
+    // Flag: --led-scan-mode=<list>
+    const char *scan_order;
+
     // Default row address type is 0, corresponding to direct setting of the
     // row, while row address type 1 is used for panels that only have A/B,
     // typically some 64x64 panels
@@ -124,6 +171,21 @@ public:
     // Type of multiplexing. 0 = direct, 1 = stripe, 2 = checker (typical 1:8)
     int multiplexing;
 
+    // Fixed time in microseconds each refresh cycle takes. Faster cycles
+    // sleep for the remaining time, so the occasional slow cycle (e.g. due
+    // to network interrupts) does not show up as brightness fluctuation.
+    // 0 = refresh as fast as possible.
+    // A negative value auto-tunes the period to what 99.9% of the cycles in
+    // the last five minutes needed.
+    // Flag: --led-frame-period=<usec|auto>
+    int frame_period_us;
+
+    // If the content did not change for a second (no swap, no drawing),
+    // refresh at most with this rate, so that the refresh thread spends most
+    // of its time sleeping. 0 = always refresh as configured.
+    // Flag: --led-idle-refresh=<Hz>
+    int idle_refresh_hz;
+
     // Disable the PWM hardware subsystem to create pulses.
     // Typically, you don't want to disable hardware pulsing, this is mostly
     // for debugging and figuring out if there is interference with the
@@ -133,9 +195,26 @@ public:
     // Flag: --led-hardware-pulse
     bool disable_hardware_pulsing;
     bool show_refresh_rate;    // Flag: --led-show-refresh
+
+    // If set, the refresh statistics (see RefreshStats) are written to this
+    // file once a second, one "name value" pair per line. The file is
+    // replaced atomically, so it can be read any time, e.g. by monitoring.
+    const char *refresh_stats_file;  // Flag: --led-refresh-stats-file
     // bool swap_green_blue; (Deprecated: use led_sequence instead)
     bool inverse_colors;       // Flag: --led-inverse
 
+    // Only refresh the bitplanes a frame actually uses: low bitplanes that
+    // are dark in all pixels of a swapped-in FrameCanvas are skipped, e.g.
+    // for simple colors without luminance correction. The pulses of the
+    // other bitplanes are shortened with the refresh cycle, so the output
+    // stays the same, but the refresh rate increases.
+    bool adaptive_pwm;         // Flag: --led-adaptive-pwm
+
+    // Stop refreshing while the current frame is completely black until
+    // there is something to show again, e.g. when a sign is blanked
+    // at night.
+    bool suspend_when_black;   // Flag: --led-suspend-black
+
     // In case the internal sequence of mapping is not "RGB", this contains the
     // real mapping. Some panels mix up these colors.
     const char *led_rgb_sequence;  // Flag: --led-rgb-sequence
@@ -144,6 +223,62 @@ public:
     // to this matrix. A semicolon-separated list of pixel-mappers with optional
     // parameter.
     const char *pixel_mapper_config;   // Flag: --led-pixel-mapper
+
+    // Directory to cache the calculated pixel mapping in. Large displays
+    // then start faster, as the mapping is only read from the file. NULL:
+    // no caching.
+    const char *mapping_cache_dir;     // Flag: --led-mapping-cache
+
+    // Scheduling of the refresh thread.
+    RealtimeOptions realtime;
+  };
+
+  // Statistics of the refresh thread since start. All times in microseconds.
+  struct RefreshStats {
+    static const int kPlanes = 16;  // Entries in per-bitplane values.
+
+    uint64_t frames;              // Refresh cycles shown.
+
+    // Time per refresh cycle, including the padding to the frame period.
+    uint32_t frame_us_p50;
+    uint32_t frame_us_p99;
+    uint32_t frame_us_p999;
+    uint32_t frame_us_max;
+
+    // Longest time sending one frame to the panel, after the first two
+    // seconds (which are prone to start-up glitches).
+    uint32_t work_us_max;
+
+    // Cycles in which sending the frame took longer than the frame period.
+    uint64_t frame_overruns;
+
+    // Sleeps while showing a bitplane that woke up later than the jitter
+    // allowance. With software pulsing, such a bitplane is shown too long.
+    // The sum of late_pulses.
+    uint64_t late_wakeups;
+
+    // Time from handing over a frame (SwapOnVSync(), SubmitFrame()) or from
+    // its presentation time (QueueFrame()) until it was on the screen.
+    uint32_t swap_latency_us_p99;
+    uint32_t swap_latency_us_max;
+
+    // Time from handing over a frame until the end of its first complete
+    // refresh cycle, when all its pixels have been lit: the latency from
+    // finishing drawing until it is entirely visible.
+    uint32_t photon_latency_us_p50;
+    uint32_t photon_latency_us_p99;
+    uint32_t photon_latency_us_max;
+
+    // Frames given to QueueFrame() that were never shown.
+    uint64_t dropped_frames;
+
+    // Bitplanes sent in the most recent refresh cycle; bit b for plane b.
+    // With adaptive_pwm, the planes that are dark in the frame are missing.
+    uint32_t planes_shown;
+
+    // Late wakeups per bitplane: if they pile up in the lower planes, the
+    // jitter allowance is too small for their pulse length.
+    uint64_t late_pulses[kPlanes];
   };
 
   // Create an RGBMatrix.
@@ -152,13 +287,21 @@ public:
   // RGBMatrix::Options struct.
   //
   // If you pass an GPIO object (which has to be Init()ialized), it will start
-  // the internal thread to start the screen immediately.
+  // the internal thread to start the screen immediately. The GPIO object is
+  // not taken over and needs to outlive the matrix (matrices created with
+  // CreateMatrixFromOptions() own theirs).
   //
   // If you need finer control over when the refresh thread starts (which you
   // might when you become a daemon), pass NULL here and see SetGPIO() method.
   //
   // The resulting canvas is (options.rows * options.parallel) high and
   // (32 * options.chain_length) wide.
+  //
+  // A process can have several RGBMatrix objects, each with its own options,
+  // e.g. for panels on different GPIO pins (the GPIO object can be shared),
+  // or one that never gets a GPIO to render a preview. Without GPIO, there
+  // is no refresh thread: SwapOnVSync() and SubmitFrame() take the frame
+  // right away, QueueFrame() is not available.
   RGBMatrix(GPIO *io, const Options &options);
 
   // Simple constructor if you don't need the fine-control with the
@@ -198,7 +341,8 @@ public:
   // description when you might want it.
   // It doesn't harm to call if the thread is already started, it is a no-op
   // then.
-  // Returns 'false' if it couldn't start because GPIO was not set yet.
+  // Returns 'false' if it couldn't start because GPIO was not set yet or could
+  // not be initialized.
   bool StartRefresh();
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
@@ -221,6 +365,16 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Set the fixed refresh cycle time in microseconds while running; see
+  // Options::frame_period_us. 0 switches it off, a negative value auto-tunes.
+  void SetFramePeriod(int usec);
+  int frame_period();
+
+  // Get the statistics of the refresh thread. Cheap and safe to call from
+  // any thread at any time; does not disturb the refresh.
+  // Returns false if the refresh thread is not running.
+  bool GetRefreshStats(RefreshStats *stats) const;
+
   //-- Double- and Multibuffering.
 
   // Create a new buffer to be used for multi-buffering. The returned new
@@ -251,6 +405,80 @@ public:
   // 28Hz animation, nicely locked to the frame-rate).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Pace SwapOnVSync() to content with the given frames per second (e.g.
+  // 25 or 30 for video), even if that is not an integer fraction of the
+  // refresh rate: frames are then shown alternately for a different number
+  // of refresh cycles, so that the rate is exact in the long run and the
+  // unevenness is as small as possible. Follows changes of the refresh rate.
+  // While set, the "framerate_fraction" of SwapOnVSync() is ignored.
+  // 0 switches it off.
+  void SetContentFrameRate(double fps);
+
+  // Triple-buffering: publish "frame" to be shown starting with the next
+  // refresh cycle, and return right away with a FrameCanvas that is free to
+  // draw the next frame on. Never blocks, so you can render as fast as you
+  // like; if you submit faster than the refresh rate, frames that were
+  // never shown are simply handed back to you.
+  //
+  // The returned canvas contains some earlier frame, so redraw it
+  // completely. Use either this or SwapOnVSync(), not both.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame);
+
+  // Timed playback: queue "frame" to be shown from the first refresh cycle
+  // starting at or after "presentation_time_ns" (CLOCK_MONOTONIC, see
+  // clock_gettime()). Frames are shown in the order they are queued, so
+  // the times should increase. If the refresh thread finds several frames
+  // due at once, only the last of these is shown, the others are dropped.
+  //
+  // Up to 16 frames can be queued; returns false if the queue is full.
+  // Frames come back via GetCompletedFrame() once they are replaced on the
+  // screen or dropped; only then they count as taken out of the queue.
+  //
+  // Don't mix with SwapOnVSync() or SubmitFrame().
+  bool QueueFrame(FrameCanvas *frame, int64_t presentation_time_ns);
+
+  // Returns a FrameCanvas that has been shown and replaced, or has been
+  // dropped, so it can be used for a new frame. Returns NULL if there is
+  // none right now; never blocks.
+  FrameCanvas *GetCompletedFrame();
+
+  // Just-in-time rendering for live data: sleeps until shortly before the
+  // next refresh boundary, so that a frame drawn right after this and handed
+  // over with SubmitFrame() (or SwapOnVSync()) makes it to that boundary
+  // with the freshest data, instead of waiting there for most of a cycle.
+  //
+  // The boundary is predicted from the refresh cycle times measured by the
+  // refresh thread. How long before it this returns adapts to how long
+  // rendering took between returning from here and handing over the frame,
+  // plus "margin_us" for safety. If the next boundary can't be made anymore,
+  // waits for the one after.
+  //
+  //   for (;;) {
+  //     matrix->WaitUntilRenderTime();
+  //     DrawLatestScores(offscreen);
+  //     offscreen = matrix->SubmitFrame(offscreen);
+  //   }
+  //
+  // Returns the predicted microseconds until the boundary.
+  int WaitUntilRenderTime(int margin_us = 200);
+
+  // For event loops (epoll, poll, libuv, ...): returns a file descriptor
+  // that becomes readable at every refresh boundary SwapOnVSync() would
+  // return on, and whenever a frame handed over with SubmitFrame() or
+  // QueueFrame() went live. It is an eventfd: read() an uint64_t to reset
+  // it; the value is the number of notifications since the last read.
+  //
+  // Together with SubmitFrame(), which never blocks, frames can be produced
+  // from the event loop without an extra thread:
+  //
+  //   int fd = matrix->GetVSyncFd();   // add to epoll, wait for EPOLLIN
+  //   ... on readable: read(fd, &count, 8); draw(offscreen);
+  //                    offscreen = matrix->SubmitFrame(offscreen);
+  //
+  // The file descriptor is owned by the RGBMatrix; don't close it.
+  // Returns -1 if the refresh thread is not running.
+  int GetVSyncFd();
+
   // Apply a pixel mapper. This is used to re-map pixels according to some
   // scheme implemented by the PixelMapper. Does not take ownership of the
   // mapper. Mapper can be NULL, in which case nothing happens.
@@ -285,6 +513,8 @@ public:
 private:
   class UpdateThread;
   friend class UpdateThread;
+  friend RGBMatrix *CreateMatrixFromOptions(const Options &options,
+                                            const RuntimeOptions &runtime);
 
   // Apply pixel mappers that have been passed down via a configuration
   // string.
@@ -301,11 +531,15 @@ private:
   FrameCanvas *active_;
 
   GPIO *io_;
+  GPIO *owned_io_;   // Created by CreateMatrixFromOptions(); deleted with us.
+  internal::PanelHardware *hardware_;
   Mutex active_frame_sync_;
 #ifndef REMOVE_DEPRECATED_TRANSFORMERS
   CanvasTransformer *transformer_;  // deprecated. To be removed.
 #endif
   UpdateThread *updater_;
+  internal::RefreshStatsCollector *refresh_stats_;
+  internal::RefreshStatsReporter *stats_reporter_;
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
 };
@@ -350,6 +584,19 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // When this canvas was shown the last time it was handed over with
+  // SwapOnVSync(), SubmitFrame() or QueueFrame(). Times are in microseconds
+  // of a free running counter, so only differences are meaningful.
+  // Valid once the canvas came back from the RGBMatrix.
+  struct Timing {
+    uint32_t submit_us;   // Handed over; with QueueFrame(): due time.
+    uint32_t live_cycle;  // Number of the refresh cycle it was first shown
+                          // in; 0 if it was replaced before being shown.
+    uint32_t live_us;     // Start of that refresh cycle.
+    uint32_t scanned_us;  // End of it: all pixels have been lit.
+  };
+  const Timing &timing() const { return timing_; }
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -358,14 +605,23 @@ public:
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Faster than setting the pixels of a rectangle one by one: fill the
+  // rectangle at (x, y) with one color, or copy "rgb" into it, which is
+  // "width" * "height" pixels of three bytes (red, green, blue) each, row by
+  // row. Parts outside the canvas are left out.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+
 private:
   friend class RGBMatrix;
 
-  FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
+  FrameCanvas(internal::Framebuffer *frame) : frame_(frame), timing_() {}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
   internal::Framebuffer *framebuffer() { return frame_; }
 
   internal::Framebuffer *const frame_;
+  Timing timing_;
 };
 
 // Runtime options to simplify doing common things for many programs such as
@@ -375,6 +631,11 @@ struct RuntimeOptions {
 
   int gpio_slowdown;    // 0 = no slowdown.          Flag: --led-slowdown-gpio
 
+  // Per-signal timing in nanoseconds as "<setup>,<hold>,<clock-high>,<strobe>".
+  // If set, this replaces the gpio_slowdown for these signals; all other
+  // writes (e.g. the row address) keep using gpio_slowdown.
+  const char *gpio_timing;  // NULL = use slowdown.  Flag: --led-gpio-timing
+
   // ----------
   // If the following options are set to disabled with -1, they are not
   // even offered via the command line flags.
@@ -16,8 +16,10 @@
 #ifndef RPI_THREAD_H
 #define RPI_THREAD_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 namespace rgb_matrix {
 // Simple thread abstraction.
@@ -40,6 +42,14 @@ public:
   // valid.
   virtual void Start(int realtime_priority = 0, uint32_t cpu_affinity_mask = 0);
 
+  // Name shown in top, ps, perf or ftrace. At most 15 characters are used.
+  // Needs to be set before Start(); the string is not copied.
+  void set_name(const char *name) { name_ = name; }
+
+  // Touch this many bytes of stack before calling Run(), so that a real-time
+  // thread does not take page faults later. Set before Start().
+  void set_stack_prefault(size_t bytes) { stack_prefault_ = bytes; }
+
   // Override this.
   virtual void Run() = 0;
 
@@ -47,6 +57,8 @@ private:
   static void *PthreadCallRun(void *tobject);
   bool started_;
   pthread_t thread_;
+  const char *name_;
+  size_t stack_prefault_;
 };
 
 // Non-recursive Mutex.
@@ -58,6 +70,20 @@ public:
   void Unlock() { pthread_mutex_unlock(&mutex_); }
   void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
 
+  // Wait on condition for at most "timeout_ms" milliseconds.
+  // Returns false on timeout.
+  bool WaitOn(pthread_cond_t *cond, long timeout_ms) {
+    struct timespec abs_time;
+    clock_gettime(CLOCK_REALTIME, &abs_time);
+    abs_time.tv_sec += timeout_ms / 1000;
+    abs_time.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (abs_time.tv_nsec >= 1000000000) {
+      abs_time.tv_nsec -= 1000000000;
+      abs_time.tv_sec += 1;
+    }
+    return pthread_cond_timedwait(cond, &mutex_, &abs_time) == 0;
+  }
+
 private:
   pthread_mutex_t mutex_;
 };
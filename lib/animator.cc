@@ -0,0 +1,80 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "animator.h"
+
+#include <string.h>
+#include <time.h>
+
+namespace rgb_matrix {
+static uint64_t MonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+Animator::Animator(RGBMatrix *matrix, double frame_rate)
+  : ThreadedCanvasManipulator(matrix), matrix_(matrix),
+    frame_rate_(frame_rate) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+Animator::~Animator() {
+  Stop();
+  WaitStopped();
+}
+
+Animator::Stats Animator::GetStats() {
+  MutexLock l(&stats_mutex_);
+  return stats_;
+}
+
+void Animator::RecordFrame(uint32_t render_us, uint32_t budget_us) {
+  MutexLock l(&stats_mutex_);
+  ++stats_.frames;
+  stats_.budget_us = budget_us;
+  stats_.render_us_avg = (stats_.frames == 1)
+    ? render_us
+    : (15 * stats_.render_us_avg + render_us) / 16;
+  if (render_us > stats_.render_us_max) stats_.render_us_max = render_us;
+  if (budget_us > 0 && render_us > budget_us) ++stats_.overruns;
+}
+
+void Animator::Run() {
+  if (frame_rate_ > 0) matrix_->SetContentFrameRate(frame_rate_);
+  FrameCanvas *offscreen = matrix_->CreateFrameCanvas();
+
+  // Without a frame rate, the budget is the time between vsyncs.
+  uint32_t budget_us = (frame_rate_ > 0) ? 1e6 / frame_rate_ : 0;
+  const uint64_t start_us = MonotonicMicros();
+  uint64_t vsync_us = start_us;   // Last time a frame went on screen.
+
+  while (running()) {
+    const uint64_t render_start_us = MonotonicMicros();
+    Render(offscreen, vsync_us + budget_us - start_us);
+    const uint64_t render_end_us = MonotonicMicros();
+    RecordFrame(render_end_us - render_start_us, budget_us);
+
+    offscreen = matrix_->SwapOnVSync(offscreen);
+    const uint64_t now_us = MonotonicMicros();
+    if (frame_rate_ <= 0) {
+      budget_us = (budget_us == 0)
+        ? now_us - vsync_us
+        : (7 * budget_us + (now_us - vsync_us)) / 8;
+    }
+    vsync_us = now_us;
+  }
+}
+}  // namespace rgb_matrix
@@ -18,6 +18,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <string>
+#include <vector>
+
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
@@ -25,27 +28,96 @@ class GPIO;
 class PinPulser;
 namespace internal {
 class RowAddressSetter;
+class PanelHardware;
+
+// The bits of the red, green and blue LED of a pixel within a gpio word,
+// and the mask that clears them. All pixels of one half of a parallel chain
+// share these, so there are only a handful.
+struct PixelColorBits {
+  gpio_bits_t r_bit;
+  gpio_bits_t g_bit;
+  gpio_bits_t b_bit;
+  gpio_bits_t mask;
+};
 
 // An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
+// to copy between PixelMappers. There is one for every pixel that is looked
+// up with each SetPixel(), so it is packed into 32 bits to keep the map
+// small enough for the cache: the offset of the pixel's first gpio word in
+// the framebuffer, and an index into the PixelColorBits of the map.
 struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0){}
-  int gpio_word;
-  uint32_t r_bit;
-  uint32_t g_bit;
-  uint32_t b_bit;
-  uint32_t mask;
+  enum {
+    kWordBits = 24,
+    kMaxGpioWord = (1 << kWordBits) - 2,   // All bits set: non-used pixel.
+    kMaxColorIndex = 0xff,
+  };
+
+  PixelDesignator() : value(~0u) {}
+  PixelDesignator(int gpio_word, int color_index)
+    : value((uint32_t)color_index << kWordBits | gpio_word) {}
+
+  bool is_used() const { return value != ~0u; }
+  int gpio_word() const { return value & ((1 << kWordBits) - 1); }
+  int color_index() const { return value >> kWordBits; }
+
+  uint32_t value;
+};
+
+// Consecutive visible pixels of a row whose gpio words follow each other
+// in the framebuffer, forwards or backwards, and which have the same color
+// bits. Most layouts consist of long runs, so bulk operations can work on
+// these instead of looking up every single PixelDesignator.
+struct DesignatorRun {
+  int x;              // First visible column.
+  int gpio_word;      // Of the pixel at x.
+  int length;         // Pixels.
+  int stride;         // +1 or -1: gpio word of the pixel at x + 1 relative
+                      // to x.
+  int color_index;
 };
 
 class PixelDesignatorMap {
 public:
   PixelDesignatorMap(int width, int height);
+  // A map whose PixelDesignators are going to be copied from "source", so
+  // shares its color bits.
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &source);
+  // A map on designators that are part of a memory mapped file, which is
+  // unmapped again with the map. See MappingCache.
+  PixelDesignatorMap(int width, int height,
+                     const std::vector<PixelColorBits> &colors,
+                     PixelDesignator *designators,
+                     void *mapping, size_t mapping_size);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
+  // Stored in visible row-major order, so that drawing along a line walks
+  // through memory.
   PixelDesignator *get(int x, int y);
 
+  // Register color bits if not known yet, returns their index. Aborts if
+  // there are too many.
+  int AddColorBits(const PixelColorBits &bits);
+  const PixelColorBits &color_bits(int index) const { return colors_[index]; }
+  const std::vector<PixelColorBits> &all_color_bits() const { return colors_; }
+
+  // All designators, row by row.
+  const PixelDesignator *designators() const { return buffer_; }
+
+  // Collect the DesignatorRuns of each row. Needs to be called whenever the
+  // designators are complete, before the runs are used.
+  void CompileRuns();
+
+  // The runs of row "y", ordered by x; non-used pixels are not covered.
+  const DesignatorRun *runs_begin(int y) const {
+    return runs_.empty() ? NULL : &runs_[0] + row_runs_[y];
+  }
+  const DesignatorRun *runs_end(int y) const {
+    return runs_.empty() ? NULL : &runs_[0] + row_runs_[y + 1];
+  }
+  bool has_runs() const { return (int)row_runs_.size() == height_ + 1; }
+
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
@@ -53,6 +125,11 @@ private:
   const int width_;
   const int height_;
   PixelDesignator *const buffer_;
+  std::vector<PixelColorBits> colors_;
+  std::vector<DesignatorRun> runs_;
+  std::vector<int> row_runs_;  // Index of first run of each row; height + 1.
+  void *const mapping_;        // If not NULL, buffer_ is within.
+  const size_t mapping_size_;
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -61,19 +138,23 @@ private:
 // written out.
 class Framebuffer {
 public:
-  Framebuffer(int rows, int columns, int parallel,
-              int scan_mode,
+  // The framebuffer is laid out for "hardware", which needs to outlive it.
+  Framebuffer(const PanelHardware *hardware,
+              int rows, int columns, int parallel,
               const char* led_sequence, bool inverse_color,
               PixelDesignatorMap **mapper);
   ~Framebuffer();
 
-  // Initialize GPIO bits for output. Only call once.
-  static void InitHardwareMapping(const char *named_hardware);
-  static void InitGPIO(GPIO *io, int rows, int parallel,
-                       bool allow_hardware_pulsing,
-                       int pwm_lsb_nanoseconds,
-                       int dither_bits,
-                       int row_address_type);
+  // Create the order in which the double rows of a panel with "rows" rows
+  // are scanned: either from one of the predefined "scan_mode"s or, if
+  // not NULL, from "scan_order", a comma separated list of double rows.
+  // Returns false and appends a message to "err" if that is not possible.
+  static bool CreateScanOrder(int rows, int scan_mode, const char *scan_order,
+                              std::vector<int> *order, std::string *err);
+
+  // Number of gpio words of a Framebuffer with the given size; all
+  // PixelDesignators of it point below that.
+  static int GpioWords(int rows, int columns);
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
@@ -92,7 +173,33 @@ public:
   }
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  // Write the framebuffer to the matrix, showing the bitplanes that are set
+  // in "plane_mask" (and within the PWM bits). Returns the bit set of
+  // bitplanes actually shown. The GPIO of the hardware needs to be
+  // initialized.
+  // The output enable pulses are "pulse_scale" / PinPulser::kFullPulseScale
+  // of their regular length.
+  // Pulses that ran late (see PinPulser::last_pulse_late()) are added to
+  // "late_pulses", which has one counter per bit of "plane_mask".
+  uint16_t DumpToMatrix(GPIO *io, uint16_t plane_mask, int pulse_scale,
+                        uint32_t *late_pulses);
+
+  // Re-calculate from the buffer which bitplanes carry any data. Writes
+  // only ever add to that set, so this is a somewhat expensive way to
+  // shrink it again; good to call once a frame is complete.
+  void UpdatePlaneOccupancy();
+
+  // The lowest bitplane carrying any data. Starting the refresh at that
+  // plane results in the same output.
+  int lowest_data_plane() const;
+
+  // True if the frame is completely dark. As this is derived from the
+  // plane occupancy, some dark frames might not be recognized, but a frame
+  // with any light never is reported as black.
+  bool is_black() const { return plane_occupancy_ == 0; }
+
+  // Changes with every modification of the content.
+  uint32_t generation() const { return generation_; }
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
@@ -106,9 +213,25 @@ public:
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Bulk versions of SetPixel() for a rectangle, clipped to the canvas:
+  // fill it with one color, or copy "rgb" into it, which is "width" times
+  // "height" pixels of three bytes each, row by row.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height, const uint8_t *rgb);
+
 private:
-  static const struct HardwareMapping *hardware_mapping_;
-  static RowAddressSetter *row_setter_;
+  friend class PanelHardware;
+
+  // Sends the bitplanes in "plane_mask" to the matrix. Instantiated for each
+  // row address setter and common slowdown (-1: any), the right one is
+  // chosen in PanelHardware::InitGPIO().
+  template <class RowSetter, int kSlowdown>
+  void DumpRows(GPIO *io, uint16_t plane_mask, uint32_t *late_pulses);
+  typedef void (Framebuffer::*DumpRowsFunction)(GPIO *io, uint16_t plane_mask,
+                                                uint32_t *late_pulses);
+  template <class RowSetter>
+  static DumpRowsFunction ChooseDumpRows(int slowdown);
 
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case led_sequence_ is _not_ "RGB"
@@ -117,15 +240,30 @@ private:
                                      gpio_bits_t default_g,
                                      gpio_bits_t default_b);
 
-  void InitDefaultDesignator(int x, int y, PixelDesignator *designator);
+  // Color bits of row "y" and the designator of pixel (x, y) before any
+  // mapping.
+  PixelColorBits DefaultColorBits(int y);
+  void InitDefaultDesignator(int x, int y, int color_index,
+                             PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+
+  // Set the color of "count" pixels starting at "gpio_word", "stride"
+  // words apart, in all bitplanes in use.
+  inline void SetColorRun(int gpio_word, int count, int stride,
+                          const PixelColorBits &colors,
+                          uint16_t red, uint16_t green, uint16_t blue);
+  // Same, with a color of its own for each of the "count" pixels.
+  inline void SetPixelRun(int gpio_word, int count, int stride,
+                          const PixelColorBits &colors,
+                          const uint16_t *red, const uint16_t *green,
+                          const uint16_t *blue);
+  const PanelHardware *const hardware_;
   const int rows_;     // Number of rows. 16 or 32.
-  const int parallel_; // Parallel rows of chains. 1 or 2.
+  const int parallel_; // Parallel rows of chains. 1..MAX_PARALLEL_CHAINS
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
 
-  const int scan_mode_;
   const char *const led_sequence_;  // Some LEDs are mapped differently.
   const bool inverse_color_;
 
@@ -133,6 +271,10 @@ private:
   bool do_luminance_correct_;
   uint8_t brightness_;
 
+  // Bit set of the bitplanes that might contain non-dark pixels.
+  uint16_t plane_occupancy_;
+  uint32_t generation_;
+
   const int double_rows_;
   const size_t buffer_size_;
 
@@ -147,6 +289,52 @@ private:
 
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
 };
+
+// The hardware the Framebuffers of one RGBMatrix are shown on: the GPIO
+// mapping and, once the GPIO is initialized, how rows are addressed, in
+// which order they are scanned and how long they are lit. As this is not
+// shared between matrices, a process can drive several of them, each with
+// its own configuration, or have some without any GPIO, e.g. for a preview.
+class PanelHardware {
+public:
+  // Use the hardware mapping with the given name; "regular" if NULL or
+  // empty. Aborts if there is no such mapping.
+  explicit PanelHardware(const char *named_hardware);
+  ~PanelHardware();
+
+  // Initialize GPIO bits for output. Only call once. Returns false if the
+  // pulses for the output enable can't be generated, then the GPIO can't
+  // be used.
+  bool InitGPIO(GPIO *io, int rows, int parallel,
+                bool allow_hardware_pulsing,
+                int pwm_lsb_nanoseconds,
+                int dither_bits,
+                int row_address_type,
+                int scan_mode, const char *scan_order,
+                int pwm_slices);
+
+  bool gpio_initialized() const { return output_enable_pulser_ != NULL; }
+  const HardwareMapping &mapping() const { return mapping_; }
+
+private:
+  friend class Framebuffer;
+
+  // One step in refreshing the panel: show "bitplane" of "double_row".
+  struct ScanStep {
+    uint8_t double_row;
+    uint8_t bitplane;
+  };
+
+  HardwareMapping mapping_;    // With max_parallel_chains determined.
+  RowAddressSetter *row_setter_;
+  std::vector<ScanStep> scan_schedule_;
+  gpio_bits_t color_clk_mask_;   // Color and clock bits while clocking in.
+  Framebuffer::DumpRowsFunction dump_rows_;
+  PinPulser *output_enable_pulser_;
+  // Bitplane of the pulse that might still be running; -1 if none. Only
+  // used by the refresh.
+  mutable int pulsed_plane_;
+};
 }  // namespace internal
 }  // namespace rgb_matrix
 #endif // RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
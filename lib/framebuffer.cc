@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <algorithm>
 
@@ -37,16 +38,43 @@ enum {
   kBitPlanes = 11  // maximum usable bitplanes.
 };
 
-// We need one global instance of a timing correct pulser. There are different
-// implementations depending on the context.
-static PinPulser *sOutputEnablePulser = NULL;
-
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
 #  define SUB_PANELS_ 2
 #endif
 
+// The color bits of one parallel chain; r1, g1, b1 for the upper and
+// r2, g2, b2 for the lower sub-panel.
+struct ChainBits {
+  gpio_bits_t r1, g1, b1;
+  gpio_bits_t r2, g2, b2;
+
+  gpio_bits_t all() const { return r1 | g1 | b1 | r2 | g2 | b2; }
+};
+
+static ChainBits GetChainBits(const HardwareMapping &h, int chain) {
+  const ChainBits chains[] = {
+    { h.p0_r1, h.p0_g1, h.p0_b1, h.p0_r2, h.p0_g2, h.p0_b2 },
+    { h.p1_r1, h.p1_g1, h.p1_b1, h.p1_r2, h.p1_g2, h.p1_b2 },
+    { h.p2_r1, h.p2_g1, h.p2_b1, h.p2_r2, h.p2_g2, h.p2_b2 },
+    { h.p3_r1, h.p3_g1, h.p3_b1, h.p3_r2, h.p3_g2, h.p3_b2 },
+    { h.p4_r1, h.p4_g1, h.p4_b1, h.p4_r2, h.p4_g2, h.p4_b2 },
+    { h.p5_r1, h.p5_g1, h.p5_b1, h.p5_r2, h.p5_g2, h.p5_b2 },
+  };
+  assert(chain >= 0 && chain < (int)(sizeof(chains) / sizeof(chains[0])));
+  return chains[chain];
+}
+
+// All color bits of the first "parallel" chains.
+static gpio_bits_t GetColorBits(const HardwareMapping &h, int parallel) {
+  gpio_bits_t result = 0;
+  for (int chain = 0; chain < parallel; ++chain) {
+    result |= GetChainBits(h, chain).all();
+  }
+  return result;
+}
+
 PixelDesignator *PixelDesignatorMap::get(int x, int y) {
   if (x < 0 || y < 0 || x >= width_ || y >= height_)
     return NULL;
@@ -55,11 +83,76 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height)
   : width_(width), height_(height),
-    buffer_(new PixelDesignator[width * height]) {
+    buffer_(new PixelDesignator[width * height]),
+    mapping_(NULL), mapping_size_(0) {
+}
+
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelDesignatorMap &source)
+  : width_(width), height_(height),
+    buffer_(new PixelDesignator[width * height]), colors_(source.colors_),
+    mapping_(NULL), mapping_size_(0) {
+}
+
+PixelDesignatorMap::PixelDesignatorMap(
+  int width, int height, const std::vector<PixelColorBits> &colors,
+  PixelDesignator *designators, void *mapping, size_t mapping_size)
+  : width_(width), height_(height), buffer_(designators), colors_(colors),
+    mapping_(mapping), mapping_size_(mapping_size) {
+}
+
+int PixelDesignatorMap::AddColorBits(const PixelColorBits &bits) {
+  for (size_t i = 0; i < colors_.size(); ++i) {
+    if (memcmp(&colors_[i], &bits, sizeof(bits)) == 0)
+      return i;
+  }
+  if (colors_.size() > PixelDesignator::kMaxColorIndex) {
+    fprintf(stderr, "Too many different pixel color bits.\n");
+    abort();
+  }
+  colors_.push_back(bits);
+  return colors_.size() - 1;
+}
+
+void PixelDesignatorMap::CompileRuns() {
+  runs_.clear();
+  row_runs_.clear();
+  for (int y = 0; y < height_; ++y) {
+    row_runs_.push_back(runs_.size());
+    const PixelDesignator *const row = buffer_ + y * width_;
+    int x = 0;
+    while (x < width_) {
+      if (!row[x].is_used()) {
+        ++x;
+        continue;
+      }
+      DesignatorRun run;
+      run.x = x;
+      run.gpio_word = row[x].gpio_word();
+      run.color_index = row[x].color_index();
+      run.length = 1;
+      run.stride = (x + 1 < width_
+                    && row[x + 1].gpio_word() == run.gpio_word - 1) ? -1 : 1;
+      while (x + run.length < width_) {
+        const PixelDesignator &next = row[x + run.length];
+        if (!next.is_used() || next.color_index() != run.color_index
+            || next.gpio_word() != run.gpio_word + run.length * run.stride)
+          break;
+        ++run.length;
+      }
+      runs_.push_back(run);
+      x += run.length;
+    }
+  }
+  row_runs_.push_back(runs_.size());
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
-  delete [] buffer_;
+  if (mapping_) {
+    munmap(mapping_, mapping_size_);
+  } else {
+    delete [] buffer_;
+  }
 }
 
 // Different panel types use different techniques to set the row address.
@@ -114,37 +207,88 @@ private:
 // This is mostly experimental at this point. It works with the one panel I have
 // seen that does AB, but might need smallish tweaks to work with all panels
 // that do this.
+//
+// The row is selected by clocking a single zero bit through a shift register.
+// A full load clocks in double_rows bits plus one extra clock, but going to
+// the next row mostly only needs to advance that zero by one or two
+// positions (progressive or interlaced scan). So we precompute, for each pair
+// of rows, how many of the last bits of the full sequence we need to clock in
+// to get the same register content, and only clock in these.
 class ShiftRegisterRowAddressSetter : public RowAddressSetter {
 public:
   ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
       row_mask_(h.a | h.b), clock_(h.a), data_(h.b),
       last_row_(-1) {
+    assert(double_rows <= 32);  // need to resize shift_count_
+    const int n = double_rows_;
+    for (int from = 0; from < n; ++from) {
+      for (int to = 0; to < n; ++to) {
+        // Clocking in the last m bits moves the existing content by m
+        // positions. Find the smallest m, for which the positions still
+        // holding old content already have the value we want.
+        int m;
+        for (m = 0; m <= n; ++m) {
+          bool matches = true;
+          for (int pos = m; pos <= n && matches; ++pos) {
+            matches = (RegisterBit(from, pos - m) == RegisterBit(to, pos));
+          }
+          if (matches) break;
+        }
+        shift_count_[from][to] = m;   // n + 1 if nothing matched: full load.
+      }
+    }
   }
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
   virtual void SetRowAddress(GPIO *io, int row) {
     if (row == last_row_) return;
-    for (int activate = 0; activate < double_rows_; ++activate) {
+    const int total = double_rows_ + 1;
+    const int count = (last_row_ < 0) ? total : shift_count_[last_row_][row];
+    for (int k = total - count; k < double_rows_; ++k) {
       io->ClearBits(clock_);
-      if (activate == double_rows_ - 1 - row) {
-        io->ClearBits(data_);
-      } else {
+      if (SequenceBit(row, k)) {
         io->SetBits(data_);
+      } else {
+        io->ClearBits(data_);
+      }
+      io->SetBits(clock_);
+    }
+    if (count > 0) {
+      // The last clock keeps the data of the previous bit.
+      if (count == 1) {
+        if (SequenceBit(row, double_rows_)) {
+          io->SetBits(data_);
+        } else {
+          io->ClearBits(data_);
+        }
       }
+      io->ClearBits(clock_);
       io->SetBits(clock_);
     }
-    io->ClearBits(clock_);
-    io->SetBits(clock_);
     last_row_ = row;
   }
 
 private:
+  // Bit k of the full sequence clocked in to select "row". The zero bit
+  // that selects the row, followed by one extra clock repeating the last bit.
+  bool SequenceBit(int row, int k) const {
+    if (k >= double_rows_) k = double_rows_ - 1;
+    return k != double_rows_ - 1 - row;
+  }
+
+  // Value at position "pos" of the shift register (0 = last clocked in)
+  // after selecting "row".
+  bool RegisterBit(int row, int pos) const {
+    return SequenceBit(row, double_rows_ - pos);
+  }
+
   const int double_rows_;
   const gpio_bits_t row_mask_;
   const gpio_bits_t clock_;
   const gpio_bits_t data_;
   int last_row_;
+  unsigned char shift_count_[32][32];
 };
 
 // The DirectABCDRowAddressSetter sets the address by one of
@@ -189,34 +333,37 @@ private:
 
 }
 
-const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
-RowAddressSetter *Framebuffer::row_setter_ = NULL;
-
-Framebuffer::Framebuffer(int rows, int columns, int parallel,
-                         int scan_mode,
+Framebuffer::Framebuffer(const PanelHardware *hardware,
+                         int rows, int columns, int parallel,
                          const char *led_sequence, bool inverse_color,
                          PixelDesignatorMap **mapper)
-  : rows_(rows),
+  : hardware_(hardware),
+    rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
-    scan_mode_(scan_mode),
     led_sequence_(led_sequence), inverse_color_(inverse_color),
     pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    plane_occupancy_(0), generation_(0),
     double_rows_(rows / SUB_PANELS_),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
     shared_mapper_(mapper) {
-  assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
+  assert(hardware_ != NULL);
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
-  if (parallel > hardware_mapping_->max_parallel_chains) {
+  const struct HardwareMapping &h = hardware_->mapping();
+  if (parallel > h.max_parallel_chains) {
     fprintf(stderr, "The %s GPIO mapping only supports %d parallel chain%s, "
-            "but %d was requested.\n", hardware_mapping_->name,
-            hardware_mapping_->max_parallel_chains,
-            hardware_mapping_->max_parallel_chains > 1 ? "s" : "", parallel);
+            "but %d was requested.\n", h.name, h.max_parallel_chains,
+            h.max_parallel_chains > 1 ? "s" : "", parallel);
+    abort();
+  }
+  assert(parallel >= 1 && parallel <= MAX_PARALLEL_CHAINS);
+  if (GpioWords(rows_, columns_) > PixelDesignator::kMaxGpioWord) {
+    fprintf(stderr, "%d columns of %d rows are too many to address.\n",
+            columns_, rows_);
     abort();
   }
-  assert(parallel >= 1 && parallel <= 3);
 
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
 
@@ -229,12 +376,15 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   // Newly created PixelMappers then can just copy around PixelDesignators
   // from the parent PixelMapper opaquely without having to know the details.
   if (*shared_mapper_ == NULL) {
-    *shared_mapper_ = new PixelDesignatorMap(columns_, height_);
+    PixelDesignatorMap *const map = new PixelDesignatorMap(columns_, height_);
     for (int y = 0; y < height_; ++y) {
+      const int color_index = map->AddColorBits(DefaultColorBits(y));
       for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, (*shared_mapper_)->get(x, y));
+        InitDefaultDesignator(x, y, color_index, map->get(x, y));
       }
     }
+    map->CompileRuns();
+    *shared_mapper_ = map;
   }
 
   Clear();
@@ -244,14 +394,20 @@ Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
 }
 
+/* static */ int Framebuffer::GpioWords(int rows, int columns) {
+  return rows / SUB_PANELS_ * columns * kBitPlanes;
+}
+
 // TODO: this should also be parsed from some special formatted string, e.g.
 // {addr={22,23,24,25,15},oe=18,clk=17,strobe=4, p0={11,27,7,8,9,10},...}
-/* static */ void Framebuffer::InitHardwareMapping(const char *named_hardware) {
+PanelHardware::PanelHardware(const char *named_hardware)
+  : row_setter_(NULL), color_clk_mask_(0), dump_rows_(NULL),
+    output_enable_pulser_(NULL), pulsed_plane_(-1) {
   if (named_hardware == NULL || *named_hardware == '\0') {
     named_hardware = "regular";
   }
 
-  struct HardwareMapping *mapping = NULL;
+  const struct HardwareMapping *mapping = NULL;
   for (HardwareMapping *it = matrix_hardware_mappings; it->name; ++it) {
     if (strcasecmp(it->name, named_hardware) == 0) {
       mapping = it;
@@ -270,51 +426,66 @@ Framebuffer::~Framebuffer() {
     abort();
   }
 
-  if (mapping->max_parallel_chains == 0) {
+  mapping_ = *mapping;
+  if (mapping_.max_parallel_chains == 0) {
     // Auto determine.
-    struct HardwareMapping *h = mapping;
-    if ((h->p0_r1 | h->p0_g1 | h->p0_g1 | h->p0_r2 | h->p0_g2 | h->p0_g2) > 0)
-      ++mapping->max_parallel_chains;
-    if ((h->p1_r1 | h->p1_g1 | h->p1_g1 | h->p1_r2 | h->p1_g2 | h->p1_g2) > 0)
-      ++mapping->max_parallel_chains;
-    if ((h->p2_r1 | h->p2_g1 | h->p2_g1 | h->p2_r2 | h->p2_g2 | h->p2_g2) > 0)
-      ++mapping->max_parallel_chains;
-  }
-  hardware_mapping_ = mapping;
-}
-
-/* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
-                                        bool allow_hardware_pulsing,
-                                        int pwm_lsb_nanoseconds,
-                                        int dither_bits,
-                                        int row_address_type) {
-  if (sOutputEnablePulser != NULL)
-    return;  // already initialized.
-
-  const struct HardwareMapping &h = *hardware_mapping_;
+    for (int chain = 0; chain < MAX_PARALLEL_CHAINS; ++chain) {
+      if (GetChainBits(mapping_, chain).all() != 0)
+        ++mapping_.max_parallel_chains;
+    }
+  }
+}
+
+PanelHardware::~PanelHardware() {
+  delete output_enable_pulser_;
+  delete row_setter_;
+}
+
+bool PanelHardware::InitGPIO(GPIO *io, int rows, int parallel,
+                             bool allow_hardware_pulsing,
+                             int pwm_lsb_nanoseconds,
+                             int dither_bits,
+                             int row_address_type,
+                             int scan_mode,
+                             const char *scan_order,
+                             int pwm_slices) {
+  assert(!gpio_initialized());  // Only call once.
+
+  std::vector<int> row_order;
+  std::string err;
+  if (!Framebuffer::CreateScanOrder(rows, scan_mode, scan_order,
+                                    &row_order, &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    abort();
+  }
+  assert(pwm_slices >= 1 && (pwm_slices & (pwm_slices - 1)) == 0);
+
+  const struct HardwareMapping &h = mapping_;
   // Tell GPIO about all bits we intend to use.
   gpio_bits_t all_used_bits = 0;
 
   all_used_bits |= h.output_enable | h.clock | h.strobe;
 
-  all_used_bits |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel >= 2) {
-    all_used_bits |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel >= 3) {
-    all_used_bits |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
-  }
+  all_used_bits |= GetColorBits(h, parallel);
+
+  color_clk_mask_ = GetColorBits(h, parallel) | h.clock;
 
   const int double_rows = rows / SUB_PANELS_;
+  const int slowdown = io->uniform_slowdown();
   switch (row_address_type) {
   case 0:
     row_setter_ = new DirectRowAddressSetter(double_rows, h);
+    dump_rows_ = Framebuffer::ChooseDumpRows<DirectRowAddressSetter>(slowdown);
     break;
   case 1:
     row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
+    dump_rows_ =
+      Framebuffer::ChooseDumpRows<ShiftRegisterRowAddressSetter>(slowdown);
     break;
   case 2:
     row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
+    dump_rows_ =
+      Framebuffer::ChooseDumpRows<DirectABCDLineRowAddressSetter>(slowdown);
     break;
   default:
     assert(0);  // unexpected type.
@@ -326,7 +497,7 @@ Framebuffer::~Framebuffer() {
   const bool is_some_adafruit_hat = (0 == strncmp(h.name, "adafruit-hat",
                                                   strlen("adafruit-hat")));
   // Initialize outputs, make sure that all of these are supported bits.
-  const uint32_t result = io->InitOutputs(all_used_bits, is_some_adafruit_hat);
+  const gpio_bits_t result = io->InitOutputs(all_used_bits, is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
   std::vector<int> bitplane_timings;
@@ -335,9 +506,125 @@ Framebuffer::~Framebuffer() {
     bitplane_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
-  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
-                                          allow_hardware_pulsing,
-                                          bitplane_timings);
+
+  // Bit angle modulation slicing: no pulse should be longer than the
+  // top bitplane divided by pwm_slices, so longer bitplanes are split into
+  // equal slices. Since bitplanes double in length, these are power of two
+  // slices. The timing of a bitplane then is the length of one slice.
+  const int max_pulse_ns = bitplane_timings[kBitPlanes - 1] / pwm_slices;
+  int slices[kBitPlanes];
+  for (int b = 0; b < kBitPlanes; ++b) {
+    slices[b] = 1;
+    while (bitplane_timings[b] / slices[b] > max_pulse_ns)
+      slices[b] *= 2;
+    bitplane_timings[b] /= slices[b];
+  }
+
+  // The schedule goes over all rows in pwm_slices passes. The first pass
+  // shows all bitplanes, the following ones the slices of the long
+  // bitplanes, spread evenly. So each LED is lit in several shorter bursts
+  // across the refresh cycle, but in sum for the same time.
+  scan_schedule_.clear();
+  for (int pass = 0; pass < pwm_slices; ++pass) {
+    for (size_t row_loop = 0; row_loop < row_order.size(); ++row_loop) {
+      for (int b = 0; b < kBitPlanes; ++b) {
+        if (pass % (pwm_slices / slices[b]) != 0)
+          continue;
+        ScanStep step;
+        step.double_row = row_order[row_loop];
+        step.bitplane = b;
+        scan_schedule_.push_back(step);
+      }
+    }
+  }
+  output_enable_pulser_ = PinPulser::Create(io, h.output_enable,
+                                            allow_hardware_pulsing,
+                                            bitplane_timings);
+  if (output_enable_pulser_ == NULL) {
+    fprintf(stderr, "Can't create output enable pulses for the '%s' "
+            "hardware mapping.\n", h.name);
+    return false;
+  }
+  return true;
+}
+
+// Rows visited in "stride" interleaved passes: 0, stride, 2*stride, ...
+// then 1, 1 + stride, ... A stride of 1 is a plain progressive scan.
+static void InterleavedScanOrder(int double_rows, int stride,
+                                 std::vector<int> *order) {
+  for (int start = 0; start < stride; ++start) {
+    for (int row = start; row < double_rows; row += stride) {
+      order->push_back(row);
+    }
+  }
+}
+
+// Rows in bit-reversed order: each following row is as far as possible from
+// the ones visited before, spreading the scan evenly across the panel.
+static void BitReversedScanOrder(int double_rows, std::vector<int> *order) {
+  int bits = 0;
+  while ((1 << bits) < double_rows) ++bits;
+  for (int i = 0; i < (1 << bits); ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (i & (1 << b)) reversed |= 1 << (bits - 1 - b);
+    }
+    if (reversed < double_rows) order->push_back(reversed);
+  }
+}
+
+/* static */ bool Framebuffer::CreateScanOrder(int rows, int scan_mode,
+                                               const char *scan_order,
+                                               std::vector<int> *order,
+                                               std::string *err) {
+  const int double_rows = rows / SUB_PANELS_;
+  order->clear();
+  if (scan_order != NULL) {
+    std::vector<bool> seen(double_rows, false);
+    const char *pos = scan_order;
+    bool valid = true;
+    for (;;) {
+      char *end;
+      const long row = strtol(pos, &end, 10);
+      if (end == pos || row < 0 || row >= double_rows || seen[row]) {
+        valid = false;
+        break;
+      }
+      seen[row] = true;
+      order->push_back(row);
+      pos = end;
+      if (*pos != ',') break;
+      ++pos;
+    }
+    if (!valid || *pos != '\0' || (int)order->size() != double_rows) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), "Scan order \"%s\" needs to be a comma "
+               "separated list of all double rows 0..%d, each once.\n",
+               scan_order, double_rows - 1);
+      err->append(msg);
+      return false;
+    }
+    return true;
+  }
+
+  switch (scan_mode) {
+  case 0:  // progressive
+    InterleavedScanOrder(double_rows, 1, order);
+    break;
+  case 1:  // interlaced
+    InterleavedScanOrder(double_rows, 2, order);
+    break;
+  case 2:  // bit-reversed
+    BitReversedScanOrder(double_rows, order);
+    break;
+  case 3:  // four-way interleave
+    InterleavedScanOrder(double_rows, 4, order);
+    break;
+  default:
+    err->append("Invalid scan mode (0..3 allowed).\n");
+    return false;
+  }
+  return true;
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
@@ -360,6 +647,8 @@ void Framebuffer::Clear() {
     // Cheaper.
     memset(bitplane_buffer_, 0,
            sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    plane_occupancy_ = 0;
+    ++generation_;
   }
 }
 
@@ -421,10 +710,17 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
 
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t all_r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2;
-  gpio_bits_t all_g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2;
-  gpio_bits_t all_b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2;
+  const struct HardwareMapping &h = hardware_->mapping();
+  gpio_bits_t all_r = 0, all_g = 0, all_b = 0;
+  for (int chain = 0; chain < MAX_PARALLEL_CHAINS; ++chain) {
+    const ChainBits c = GetChainBits(h, chain);
+    all_r |= c.r1 | c.r2;
+    all_g |= c.g1 | c.g2;
+    all_b |= c.b1 | c.b2;
+  }
+
+  plane_occupancy_ = inverse_color_ ? ~(red & green & blue) : (red|green|blue);
+  ++generation_;
 
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
     uint16_t mask = 1 << b;
@@ -434,7 +730,7 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
     plane_bits |= ((blue & mask) == mask)  ? all_b : 0;
 
     for (int row = 0; row < double_rows_; ++row) {
-      uint32_t *row_data = ValueAt(row, 0, b);
+      gpio_bits_t *row_data = ValueAt(row, 0, b);
       for (int col = 0; col < columns_; ++col) {
         *row_data++ = plane_bits;
       }
@@ -446,23 +742,27 @@ int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  PixelDesignatorMap *const map = *shared_mapper_;
+  const PixelDesignator *designator = map->get(x, y);
   if (designator == NULL) return;
-  const int pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (!designator->is_used()) return;  // non-used pixel marker.
+  const int pos = designator->gpio_word();
+  const PixelColorBits &colors = map->color_bits(designator->color_index());
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  plane_occupancy_ |= inverse_color_ ? ~(red & green & blue) : (red|green|blue);
+  ++generation_;
 
-  uint32_t *bits = bitplane_buffer_ + pos;
+  gpio_bits_t *bits = bitplane_buffer_ + pos;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
-  const uint32_t r_bits = designator->r_bit;
-  const uint32_t g_bits = designator->g_bit;
-  const uint32_t b_bits = designator->b_bit;
-  const uint32_t designator_mask = designator->mask;
+  const gpio_bits_t r_bits = colors.r_bit;
+  const gpio_bits_t g_bits = colors.g_bit;
+  const gpio_bits_t b_bits = colors.b_bit;
+  const gpio_bits_t designator_mask = colors.mask;
   for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    uint32_t color_bits = 0;
+    gpio_bits_t color_bits = 0;
     if (red & mask)   color_bits |= r_bits;
     if (green & mask) color_bits |= g_bits;
     if (blue & mask)  color_bits |= b_bits;
@@ -471,6 +771,130 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   }
 }
 
+inline void Framebuffer::SetColorRun(int gpio_word, int count, int stride,
+                                     const PixelColorBits &colors,
+                                     uint16_t red, uint16_t green,
+                                     uint16_t blue) {
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t *bits = bitplane_buffer_ + gpio_word + columns_ * min_bit_plane;
+  const gpio_bits_t keep = colors.mask;
+  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
+    gpio_bits_t color_bits = 0;
+    if (red & mask)   color_bits |= colors.r_bit;
+    if (green & mask) color_bits |= colors.g_bit;
+    if (blue & mask)  color_bits |= colors.b_bit;
+    // Separate loops for either direction, so that the compiler can
+    // vectorize them; single pixels (e.g. rotated by 90 degrees) without
+    // the loop overhead.
+    if (count == 1) {
+      *bits = (*bits & keep) | color_bits;
+    } else if (stride > 0) {
+      for (int i = 0; i < count; ++i)
+        bits[i] = (bits[i] & keep) | color_bits;
+    } else {
+      for (int i = 0; i < count; ++i)
+        bits[-i] = (bits[-i] & keep) | color_bits;
+    }
+    bits += columns_;
+  }
+}
+
+inline void Framebuffer::SetPixelRun(int gpio_word, int count, int stride,
+                                     const PixelColorBits &colors,
+                                     const uint16_t *red,
+                                     const uint16_t *green,
+                                     const uint16_t *blue) {
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t *bits = bitplane_buffer_ + gpio_word + columns_ * min_bit_plane;
+  const gpio_bits_t keep = colors.mask;
+  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
+    for (int i = 0; i < count; ++i) {
+      gpio_bits_t color_bits = 0;
+      if (red[i] & mask)   color_bits |= colors.r_bit;
+      if (green[i] & mask) color_bits |= colors.g_bit;
+      if (blue[i] & mask)  color_bits |= colors.b_bit;
+      gpio_bits_t *const pixel_bits = bits + i * stride;
+      *pixel_bits = (*pixel_bits & keep) | color_bits;
+    }
+    bits += columns_;
+  }
+}
+
+// Clip the rectangle to the canvas. Returns false if nothing is left.
+static bool ClipRect(int width, int height,
+                     int *x0, int *y0, int *x1, int *y1) {
+  *x0 = std::max(*x0, 0);
+  *y0 = std::max(*y0, 0);
+  *x1 = std::min(*x1, width);
+  *y1 = std::min(*y1, height);
+  return *x0 < *x1 && *y0 < *y1;
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  PixelDesignatorMap *const map = *shared_mapper_;
+  assert(map->has_runs());
+  int x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+  if (!ClipRect(map->width(), map->height(), &x0, &y0, &x1, &y1))
+    return;
+
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  plane_occupancy_ |= inverse_color_ ? ~(red & green & blue) : (red|green|blue);
+  ++generation_;
+
+  for (int row = y0; row < y1; ++row) {
+    const DesignatorRun *const end = map->runs_end(row);
+    for (const DesignatorRun *run = map->runs_begin(row); run < end; ++run) {
+      if (run->x >= x1) break;
+      const int begin_x = std::max(x0, run->x);
+      const int end_x = std::min(x1, run->x + run->length);
+      if (begin_x >= end_x) continue;
+      SetColorRun(run->gpio_word + (begin_x - run->x) * run->stride,
+                  end_x - begin_x, run->stride,
+                  map->color_bits(run->color_index), red, green, blue);
+    }
+  }
+}
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb) {
+  PixelDesignatorMap *const map = *shared_mapper_;
+  assert(map->has_runs());
+  int x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+  if (!ClipRect(map->width(), map->height(), &x0, &y0, &x1, &y1))
+    return;
+
+  // The mapped colors of up to kChunk pixels of a run at a time, so that
+  // each bitplane row is only visited once per chunk.
+  static const int kChunk = 64;
+  uint16_t red[kChunk], green[kChunk], blue[kChunk];
+  uint16_t occupancy = 0;
+  for (int row = y0; row < y1; ++row) {
+    const uint8_t *const row_rgb = rgb + 3 * (size_t)(row - y) * width;
+    const DesignatorRun *const end = map->runs_end(row);
+    for (const DesignatorRun *run = map->runs_begin(row); run < end; ++run) {
+      if (run->x >= x1) break;
+      const int begin_x = std::max(x0, run->x);
+      const int end_x = std::min(x1, run->x + run->length);
+      const PixelColorBits &colors = map->color_bits(run->color_index);
+      for (int col = begin_x; col < end_x; col += kChunk) {
+        const int count = std::min(end_x - col, kChunk);
+        const uint8_t *pixel = row_rgb + 3 * (col - x);
+        for (int i = 0; i < count; ++i, pixel += 3) {
+          MapColors(pixel[0], pixel[1], pixel[2], &red[i], &green[i], &blue[i]);
+          occupancy |= inverse_color_
+            ? ~(red[i] & green[i] & blue[i]) : (red[i] | green[i] | blue[i]);
+        }
+        SetPixelRun(run->gpio_word + (col - run->x) * run->stride, count,
+                    run->stride, colors, red, green, blue);
+      }
+    }
+  }
+  plane_occupancy_ |= occupancy;
+  ++generation_;
+}
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 gpio_bits_t default_r,
@@ -491,46 +915,26 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
   return default_r;  // String too long, should've been caught earlier.
 }
 
-void Framebuffer::InitDefaultDesignator(int x, int y, PixelDesignator *d) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  uint32_t *bits = ValueAt(y % double_rows_, x, 0);
-  d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
-  if (y < rows_) {
-    if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', h.p0_r1, h.p0_g1, h.p0_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', h.p0_r2, h.p0_g2, h.p0_b2);
-    }
-  }
-  else if (y >= rows_ && y < 2 * rows_) {
-    if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', h.p1_r1, h.p1_g1, h.p1_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', h.p1_r2, h.p1_g2, h.p1_b2);
-    }
-  }
-  else {
-    if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', h.p2_r1, h.p2_g1, h.p2_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', h.p2_r2, h.p2_g2, h.p2_b2);
-    }
+PixelColorBits Framebuffer::DefaultColorBits(int y) {
+  const ChainBits c = GetChainBits(hardware_->mapping(), y / rows_);
+  PixelColorBits result;
+  if (y % rows_ < double_rows_) {
+    result.r_bit = GetGpioFromLedSequence('R', c.r1, c.g1, c.b1);
+    result.g_bit = GetGpioFromLedSequence('G', c.r1, c.g1, c.b1);
+    result.b_bit = GetGpioFromLedSequence('B', c.r1, c.g1, c.b1);
+  } else {
+    result.r_bit = GetGpioFromLedSequence('R', c.r2, c.g2, c.b2);
+    result.g_bit = GetGpioFromLedSequence('G', c.r2, c.g2, c.b2);
+    result.b_bit = GetGpioFromLedSequence('B', c.r2, c.g2, c.b2);
   }
+  result.mask = ~(result.r_bit | result.g_bit | result.b_bit);
+  return result;
+}
 
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+void Framebuffer::InitDefaultDesignator(int x, int y, int color_index,
+                                        PixelDesignator *d) {
+  gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
+  *d = PixelDesignator(bits - bitplane_buffer_, color_index);
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
@@ -541,71 +945,145 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
   memcpy(bitplane_buffer_, data, len);
+  UpdatePlaneOccupancy();
+  ++generation_;
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  plane_occupancy_ = other->plane_occupancy_;
+  ++generation_;
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+void Framebuffer::UpdatePlaneOccupancy() {
+  // A dark pixel has all color bits set in inverse mode; see Fill().
+  gpio_bits_t dark = 0;
+  if (inverse_color_) {
+    dark = GetColorBits(hardware_->mapping(), MAX_PARALLEL_CHAINS);
   }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+
+  uint16_t occupancy = 0;
+  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
+    const uint16_t plane = 1 << b;
+    for (int row = 0; row < double_rows_ && !(occupancy & plane); ++row) {
+      const gpio_bits_t *row_data = ValueAt(row, 0, b);
+      for (int col = 0; col < columns_; ++col) {
+        if (row_data[col] != dark) {
+          occupancy |= plane;
+          break;
+        }
+      }
+    }
   }
+  plane_occupancy_ = occupancy;
+}
 
-  color_clk_mask |= h.clock;
+int Framebuffer::lowest_data_plane() const {
+  // Completely dark frames still show the top plane, so that the refresh
+  // keeps its usual pace.
+  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes - 1; ++b) {
+    if (plane_occupancy_ & (1 << b))
+      return b;
+  }
+  return kBitPlanes - 1;
+}
 
-  // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
+// Clock in one column: color bits and falling clock, then rising edge.
+template <int kSlowdown>
+static inline void ClockInColumn(GPIO *io, gpio_bits_t value,
+                                 gpio_bits_t mask, gpio_bits_t clock) {
+  if (kSlowdown < 0) {
+    io->ClockInData(value, mask, clock);
+  } else {
+    io->ClockInDataFixed<kSlowdown < 0 ? 0 : kSlowdown>(value, mask, clock);
+  }
+}
 
-  const uint8_t half_double = double_rows_/2;
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
-      break;
+template <class RowSetter>
+/* static */ Framebuffer::DumpRowsFunction
+Framebuffer::ChooseDumpRows(int slowdown) {
+  switch (slowdown) {
+  case 0: return &Framebuffer::DumpRows<RowSetter, 0>;
+  case 1: return &Framebuffer::DumpRows<RowSetter, 1>;
+  case 2: return &Framebuffer::DumpRows<RowSetter, 2>;
+  default: return &Framebuffer::DumpRows<RowSetter, -1>;
+  }
+}
 
-    case 1:  // interlaced
-      d_row = ((row_loop < half_double)
-               ? (row_loop << 1)
-               : ((row_loop - half_double) << 1) + 1);
+template <class RowSetter, int kSlowdown>
+void Framebuffer::DumpRows(GPIO *io, uint16_t plane_mask,
+                           uint32_t *late_pulses) {
+  const PanelHardware &hw = *hardware_;
+  const gpio_bits_t color_clk_mask = hw.color_clk_mask_;
+  const gpio_bits_t clock = hw.mapping_.clock;
+  const gpio_bits_t strobe = hw.mapping_.strobe;
+  RowSetter *const row_setter = static_cast<RowSetter*>(hw.row_setter_);
+  PinPulser *const pulser = hw.output_enable_pulser_;
+
+  // Rows can't be switched very quickly without ghosting, so the schedule
+  // does the full PWM of one row before switching rows (but might come
+  // back for slices of long bitplanes later).
+  typedef PanelHardware::ScanStep ScanStep;
+  const ScanStep *const schedule_begin = &hw.scan_schedule_[0];
+  const ScanStep *const schedule_end =
+    schedule_begin + hw.scan_schedule_.size();
+  int pulsed_plane = hw.pulsed_plane_;
+  for (const ScanStep *step = schedule_begin; step < schedule_end; ++step) {
+    const int b = step->bitplane;
+    if ((plane_mask & (1 << b)) == 0)
+      continue;
+    const int d_row = step->double_row;
+    const gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+    const gpio_bits_t *const row_end = row_data + columns_;
+    // While the output enable is still on, we can already clock in the next
+    // data. Unrolled, and fetching ahead as on the older Pis there is no
+    // hardware prefetcher.
+    for (/**/; row_data + 4 <= row_end; row_data += 4) {
+      __builtin_prefetch(row_data + 16);
+      ClockInColumn<kSlowdown>(io, row_data[0], color_clk_mask, clock);
+      ClockInColumn<kSlowdown>(io, row_data[1], color_clk_mask, clock);
+      ClockInColumn<kSlowdown>(io, row_data[2], color_clk_mask, clock);
+      ClockInColumn<kSlowdown>(io, row_data[3], color_clk_mask, clock);
+    }
+    for (/**/; row_data < row_end; ++row_data) {
+      ClockInColumn<kSlowdown>(io, *row_data, color_clk_mask, clock);
     }
+    io->ClearBits(color_clk_mask);    // clock back to normal.
 
-    // Rows can't be switched very quickly without ghosting, so we do the
-    // full PWM of one row before switching rows.
-    for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
-      }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
+    // Get the start of the next row into the cache while we wait.
+    if (step + 1 < schedule_end) {
+      __builtin_prefetch(ValueAt(step[1].double_row, 0, step[1].bitplane));
+    }
 
-      // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
+    // OE of the previous row-data must be finished before strobe.
+    pulser->WaitPulseFinished();
+    if (pulsed_plane >= 0 && pulser->last_pulse_late()) {
+      ++late_pulses[pulsed_plane];
+    }
 
-      // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
+    // Setting address and strobing needs to happen in dark time. The
+    // qualified call avoids going through the vtable.
+    row_setter->RowSetter::SetRowAddress(io, d_row);
 
-      io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
-      io->ClearBits(h.strobe);
+    io->Strobe(strobe);   // Strobe in the previously clocked in row.
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
-    }
+    // Now switch on for the sleep time necessary for that bit-plane.
+    pulser->SendPulse(b);
+    pulsed_plane = b;
   }
+  hw.pulsed_plane_ = pulsed_plane;   // Accounted for in the next call.
+}
+
+uint16_t Framebuffer::DumpToMatrix(GPIO *io, uint16_t plane_mask,
+                                   int pulse_scale, uint32_t *late_pulses) {
+  // Only the top pwm_bits_ planes are in use.
+  plane_mask &= ((1 << kBitPlanes) - 1) & ~((1 << (kBitPlanes - pwm_bits_)) - 1);
+  assert(hardware_->gpio_initialized());
+  hardware_->output_enable_pulser_->SetPulseScale(pulse_scale);
+  (this->*hardware_->dump_rows_)(io, plane_mask, late_pulses);
+  return plane_mask;
 }
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -0,0 +1,35 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_RGBMATRIX_GPIO_INTERNAL_H
+#define RPI_RGBMATRIX_GPIO_INTERNAL_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+namespace internal {
+
+// Number of 32 bit words of the GPIO register block.
+static const int kGPIORegisterWords = 64;
+
+// For tests: the next GPIO::Init() writes to "registers" instead of the
+// GPIO registers of the Pi, so the refresh runs without any hardware.
+// "registers" needs room for kGPIORegisterWords words, which are used the
+// same way as the real ones.
+void UseGPIORegistersForTesting(volatile uint32_t *registers);
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_GPIO_INTERNAL_H
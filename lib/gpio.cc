@@ -17,8 +17,10 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "gpio-internal.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +29,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 /*
  * nanosleep() takes longer than requested because of OS jitter.
  * In about 99.9% of the cases, this is <= 25 microcseconds on
@@ -34,7 +38,11 @@
  * we substract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * This is only the starting value: while running, we record how late we
+ * actually wake up and adapt the allowance to what the kernel we're running
+ * on needs (see RecordOvershoot()).
+ *
+ * You can look at the overhead using DEBUG_SLEEP_JITTER below.
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
@@ -57,16 +65,34 @@
  */
 #define EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US 35
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
+/* To see how the values above compare to reality, set this to 1.
  * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
+ * the requested time. The same data is available at runtime with
+ * PinPulser::GetOvershootHistogram().
  */
 #define DEBUG_SLEEP_JITTER 0
 
-// Raspberry 1 and 2 have different base addresses for the periphery
+/*
+ * Number of sleeps after which we re-evaluate the jitter allowance, and the
+ * fraction of sleeps (in parts per million) that are allowed to overshoot it.
+ * Like with the empirical values above, we are more generous with busy
+ * waiting on the multi-core Pis.
+ */
+#define JITTER_ADAPT_WINDOW 20000
+#define JITTER_ALLOWED_MISSES_PPM_SINGLE_CORE 1000  // 99.9%
+#define JITTER_ALLOWED_MISSES_PPM_MULTI_CORE   100  // 99.99%
+
+/*
+ * Short waits are busy loops. The time a loop iteration takes depends on the
+ * CPU and its current clock frequency, so it is measured at startup. With
+ * CPU frequency scaling it changes while running, so every so many busy waits
+ * of at least the given length, we measure again and correct.
+ */
+#define BUSY_LOOP_CHECK_INTERVAL  256
+#define BUSY_LOOP_CHECK_MIN_NANOS 4000
+
+// Raspberry 1 and 2 have different base addresses for the periphery. This
+// is only a fallback if the device tree does not tell us.
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
 
@@ -121,7 +147,7 @@
 #define GPIO_CLR *(gpio+10) // clears bits which are 1 ignores bits which are 0
 
 namespace rgb_matrix {
-/*static*/ const uint32_t GPIO::kValidBits
+/*static*/ const gpio_bits_t GPIO::kValidBits
 = ((1 <<  0) | (1 <<  1) | // RPi 1 - Revision 1 accessible
    (1 <<  2) | (1 <<  3) | // RPi 1 - Revision 2 accessible
    (1 <<  4) | (1 <<  7) | (1 << 8) | (1 <<  9) |
@@ -130,12 +156,18 @@ namespace rgb_matrix {
    // support for A+/B+ and RPi2 with additional GPIO pins.
    (1 <<  5) | (1 <<  6) | (1 << 12) | (1 << 13) | (1 << 16) |
    (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26)
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+   // Compute Module: GPIO 28..45 are accessible as well.
+   | (((gpio_bits_t)1 << 46) - ((gpio_bits_t)1 << 28))
+#endif
 );
 
-GPIO::GPIO() : output_bits_(0), slowdown_(1), gpio_port_(NULL) {
+GPIO::GPIO() : output_bits_(0), slowdown_(1),
+               data_setup_writes_(1), clock_high_writes_(1), strobe_writes_(1),
+               write_nanos_(0), gpio_port_(NULL) {
 }
 
-uint32_t GPIO::InitOutputs(uint32_t outputs,
+gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
                            bool adafruit_pwm_transition_hack_needed) {
   if (gpio_port_ == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
@@ -157,18 +189,18 @@ uint32_t GPIO::InitOutputs(uint32_t outputs,
   }
 
   outputs &= kValidBits;   // Sanitize input.
-  output_bits_ = outputs;
-  for (uint32_t b = 0; b <= 27; ++b) {
-    if (outputs & (1 << b)) {
+  output_bits_ |= outputs;
+  for (int b = 0; b < (int)sizeof(gpio_bits_t) * 8; ++b) {
+    if (outputs & ((gpio_bits_t)1 << b)) {
       INP_GPIO(b);   // for writing, we first need to set as input.
       OUT_GPIO(b);
     }
   }
-  return output_bits_;
+  return outputs;
 }
 
+// Without a device tree, the memory size is our best guess.
 static bool DetermineIsRaspberryPi2() {
-  // TODO: there must be a better, more robust way. Can we ask the processor ?
   char buffer[2048];
   const int fd = open("/proc/cmdline", O_RDONLY);
   ssize_t r = read(fd, buffer, sizeof(buffer) - 1); // returns all in one read.
@@ -184,21 +216,154 @@ static bool DetermineIsRaspberryPi2() {
   return false;
 }
 
-static bool IsRaspberryPi2() {
-  static bool ispi2 = DetermineIsRaspberryPi2();
-  return ispi2;
+static uint32_t ReadBigEndian32(const unsigned char *p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// The soc ranges in the device tree map the bus address of the periphery
+// to the physical address we need. The latter is the second word, or on
+// boards with 64 bit physical addresses (Pi 4) the third.
+static off_t DeterminePeripheralBase() {
+  unsigned char ranges[12];
+  const int fd = open("/proc/device-tree/soc/ranges", O_RDONLY);
+  if (fd >= 0) {
+    const ssize_t r = read(fd, ranges, sizeof(ranges));
+    close(fd);
+    uint32_t base = (r >= 8) ? ReadBigEndian32(ranges + 4) : 0;
+    if (base == 0 && r >= 12) base = ReadBigEndian32(ranges + 8);
+    if (base != 0) return base;
+  }
+  return DetermineIsRaspberryPi2() ? BCM2709_PERI_BASE : BCM2708_PERI_BASE;
 }
 
-static uint32_t JitterAllowanceMicroseconds() {
-  // If this is a Raspberry Pi2 or 3, we can allow to burn a bit more busy-wait
-  // CPU cycles to get the timing accurate as we have more CPU to spare.
-  static int allowance_us = EMPIRICAL_NANOSLEEP_OVERHEAD_US
-    + (IsRaspberryPi2() ? EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US : 0);
+static off_t PeripheralBase() {
+  static off_t base = DeterminePeripheralBase();
+  return base;
+}
+
+// The newer Pis have more than one core, so we can afford to burn more of
+// them in busy waits.
+static bool HasMultipleCores() {
+  static bool multi_core = sysconf(_SC_NPROCESSORS_CONF) > 1;
+  return multi_core;
+}
+
+// Sleep overshoot statistics. Only the refresh thread writes them, but they
+// can be read any time, so all access is with atomic builtins. Relaxed
+// ordering is fine: each counter is meaningful on its own.
+#define MAX_JITTER_TIME_SPECS 32
+static uint64_t overshoot_histogram_us[MAX_JITTER_TIME_SPECS]
+                                      [PinPulser::kOvershootBuckets];
+static uint32_t window_histogram_us[PinPulser::kOvershootBuckets];
+static uint32_t window_samples = 0;
+static int jitter_allowance_us = -1;  // Not yet determined.
+
+/*static*/ int PinPulser::JitterAllowanceMicroseconds() {
+  int allowance_us = __atomic_load_n(&jitter_allowance_us, __ATOMIC_RELAXED);
+  if (allowance_us < 0) {
+    // If this is a Raspberry Pi with multiple cores, we can allow to burn a
+    // bit more busy-wait CPU cycles to get the timing accurate as we have
+    // more CPU to spare.
+    allowance_us = EMPIRICAL_NANOSLEEP_OVERHEAD_US
+      + (HasMultipleCores() ? EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US : 0);
+    __atomic_store_n(&jitter_allowance_us, allowance_us, __ATOMIC_RELAXED);
+  }
   return allowance_us;
 }
 
-static uint32_t *mmap_bcm_register(bool isRPi2, off_t register_offset) {
-  const off_t base = (isRPi2 ? BCM2709_PERI_BASE : BCM2708_PERI_BASE);
+/*static*/ bool PinPulser::GetOvershootHistogram(int time_spec_number,
+                                                 uint64_t *histogram) {
+  if (time_spec_number < 0 || time_spec_number >= MAX_JITTER_TIME_SPECS)
+    return false;
+  for (int i = 0; i < kOvershootBuckets; ++i) {
+    histogram[i] = __atomic_load_n(&overshoot_histogram_us[time_spec_number][i],
+                                   __ATOMIC_RELAXED);
+  }
+  return true;
+}
+
+// Set the jitter allowance to what covered the requested percentile of
+// sleeps in the last window. Larger values are taken right away, smaller
+// ones only approached slowly, so that a single quiet window does not make us
+// miss deadlines once things get busy again.
+static void AdaptJitterAllowance() {
+  const uint32_t allowed_misses_ppm = HasMultipleCores()
+    ? JITTER_ALLOWED_MISSES_PPM_MULTI_CORE
+    : JITTER_ALLOWED_MISSES_PPM_SINGLE_CORE;
+  uint32_t total = 0;
+  uint32_t counts[PinPulser::kOvershootBuckets];
+  for (int i = 0; i < PinPulser::kOvershootBuckets; ++i) {
+    counts[i] = __atomic_exchange_n(&window_histogram_us[i], 0,
+                                    __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total == 0) return;
+  const uint64_t allowed_misses = (uint64_t)total * allowed_misses_ppm / 1000000;
+  uint64_t misses = total;
+  int needed_us = 0;
+  while (needed_us < PinPulser::kOvershootBuckets - 1) {
+    misses -= counts[needed_us];
+    if (misses <= allowed_misses) break;
+    ++needed_us;
+  }
+  needed_us += 1;  // Bucket is rounded down.
+  const int current_us = PinPulser::JitterAllowanceMicroseconds();
+  const int new_us = (needed_us >= current_us)
+    ? needed_us
+    : current_us - (current_us - needed_us + 1) / 2;
+  __atomic_store_n(&jitter_allowance_us, new_us, __ATOMIC_RELAXED);
+}
+
+static void RecordOvershoot(int time_spec_number, long overshoot_nanos) {
+  int overshoot_us = overshoot_nanos / 1000;
+  if (overshoot_us < 0) overshoot_us = 0;
+  if (overshoot_us >= PinPulser::kOvershootBuckets)
+    overshoot_us = PinPulser::kOvershootBuckets - 1;
+  if (time_spec_number >= MAX_JITTER_TIME_SPECS)
+    time_spec_number = MAX_JITTER_TIME_SPECS - 1;
+  __atomic_fetch_add(&overshoot_histogram_us[time_spec_number][overshoot_us],
+                     1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&window_histogram_us[overshoot_us], 1, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&window_samples, 1, __ATOMIC_RELAXED)
+      >= JITTER_ADAPT_WINDOW) {
+    __atomic_store_n(&window_samples, 0, __ATOMIC_RELAXED);
+    AdaptJitterAllowance();
+  }
+}
+
+static long DiffNanos(const struct timespec &a, const struct timespec &b) {
+  return (a.tv_sec - b.tv_sec) * 1000000000L + (a.tv_nsec - b.tv_nsec);
+}
+
+static struct timespec AddNanos(const struct timespec &t, long nanos) {
+  struct timespec result = t;
+  result.tv_sec += nanos / 1000000000L;
+  result.tv_nsec += nanos % 1000000000L;
+  if (result.tv_nsec >= 1000000000L) {
+    result.tv_nsec -= 1000000000L;
+    result.tv_sec += 1;
+  }
+  return result;
+}
+
+// Sleep until the absolute CLOCK_MONOTONIC time "wakeup". With an absolute
+// deadline, time lost before going to sleep does not add up. Records how late
+// we actually woke up and returns true if that was more than the jitter
+// allowance.
+static bool SleepUntil(const struct timespec &wakeup, int time_spec_number) {
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL)
+         == EINTR) {
+    // Interrupted by signal; continue sleeping.
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const long overshoot_nanos = DiffNanos(now, wakeup);
+  RecordOvershoot(time_spec_number, overshoot_nanos);
+  return overshoot_nanos > PinPulser::JitterAllowanceMicroseconds() * 1000L;
+}
+
+static uint32_t *mmap_bcm_register(off_t register_offset) {
+  const off_t base = PeripheralBase();
 
   int mem_fd;
   if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
@@ -218,17 +383,29 @@ static uint32_t *mmap_bcm_register(bool isRPi2, off_t register_offset) {
 
   if (result == MAP_FAILED) {
     perror("mmap error: ");
-    fprintf(stderr, "%s: MMapping from base 0x%lx, offset 0x%lx\n",
-            isRPi2 ? "RPi2,3" : "RPi1", base, register_offset);
+    fprintf(stderr, "MMapping from base 0x%lx, offset 0x%lx\n",
+            base, register_offset);
     return NULL;
   }
   return result;
 }
 
+static volatile uint32_t *registers_for_testing = NULL;
+
+void internal::UseGPIORegistersForTesting(volatile uint32_t *registers) {
+  registers_for_testing = registers;
+}
+
 // Based on code example found in http://elinux.org/RPi_Low-level_peripherals
 bool GPIO::Init(int slowdown) {
   slowdown_ = slowdown;
-  gpio_port_ = mmap_bcm_register(IsRaspberryPi2(), GPIO_REGISTER_OFFSET);
+  data_setup_writes_ = clock_high_writes_ = strobe_writes_ = slowdown;
+  if (registers_for_testing != NULL) {
+    gpio_port_ = registers_for_testing;
+    registers_for_testing = NULL;
+  } else {
+    gpio_port_ = mmap_bcm_register(GPIO_REGISTER_OFFSET);
+  }
   if (gpio_port_ == NULL) {
     return false;
   }
@@ -237,10 +414,55 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+// Measure how long a single write to the GPIO takes. We write zero to the
+// set register, which has no effect on the outputs. Take the fastest of a
+// few runs to not be fooled by being preempted in the middle.
+static int MeasureWriteNanos(volatile uint32_t *reg) {
+  static const int kWrites = 10000;
+  int64_t best = -1;
+  for (int run = 0; run < 5; ++run) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < kWrites; ++i) {
+      *reg = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const int64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL
+      + (end.tv_nsec - start.tv_nsec);
+    if (best < 0 || elapsed < best) best = elapsed;
+  }
+  const int result = best / kWrites;
+  return result > 0 ? result : 1;
+}
+
+// Number of additional writes needed to keep a signal for at least
+// "nanos"; the write itself already lasts one write time.
+static int ExtraWritesFor(int nanos, int write_nanos) {
+  if (nanos <= write_nanos) return 0;
+  return (nanos + write_nanos - 1) / write_nanos - 1;
+}
+
+void GPIO::SetTiming(const Timing &timing) {
+  if (gpio_port_ == NULL) {
+    fprintf(stderr, "Attempt to set GPIO timing before initialization\n");
+    return;
+  }
+  write_nanos_ = MeasureWriteNanos(gpio_set_bits_);
+  // Everything that is not explicitly timed (row address, output enable,
+  // falling clock and strobe edges) keeps the slowdown of Init().
+  data_setup_writes_ = ExtraWritesFor(timing.data_setup_ns, write_nanos_);
+  // The data only changes with the next falling clock, so the clock high
+  // time also guarantees the hold time.
+  const int high_ns = (timing.clock_high_ns > timing.data_hold_ns)
+    ? timing.clock_high_ns : timing.data_hold_ns;
+  clock_high_writes_ = ExtraWritesFor(high_ns, write_nanos_);
+  strobe_writes_ = ExtraWritesFor(timing.strobe_ns, write_nanos_);
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
- * Hence all various sleep_nano() implementations depending on the hardware.
+ * That is a mix of sleeping and busy waiting, see Timers::sleep_nanos().
  */
 
 // --- PinPulser. Private implementation parts.
@@ -249,26 +471,28 @@ namespace {
 class Timers {
 public:
   static bool Init();
-  static void sleep_nanos(long t);
+  // Returns false if the deadline was missed.
+  static bool sleep_nanos(long t, int time_spec_number);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
 // to get the timing, but not optimal.
 class TimerBasedPinPulser : public PinPulser {
 public:
-  TimerBasedPinPulser(GPIO *io, uint32_t bits,
+  TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
     : io_(io), bits_(bits), nano_specs_(nano_specs) {}
 
   virtual void SendPulse(int time_spec_number) {
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    last_pulse_late_ = !Timers::sleep_nanos(
+      ScaledLength(nano_specs_[time_spec_number]), time_spec_number);
     io_->SetBits(bits_);
   }
 
 private:
   GPIO *const io_;
-  const uint32_t bits_;
+  const gpio_bits_t bits_;
   const std::vector<int> nano_specs_;
 };
 
@@ -290,9 +514,77 @@ static bool LinuxHasModuleLoaded(const char *name) {
 
 static volatile uint32_t *timer1Mhz = NULL;
 
-static void sleep_nanos_rpi_1(long nanos);
-static void sleep_nanos_rpi_2(long nanos);
-static void (*busy_sleep_impl)(long) = sleep_nanos_rpi_1;
+// Busy loop speed in iterations per 1024 nanoseconds and the fixed cost of
+// a busy wait; see CalibrateBusyLoop().
+static uint32_t busy_loops_per_1024ns = 1024;
+static long busy_loop_overhead_nanos = 0;
+static long clock_read_nanos = 0;  // Cost of clock_gettime() itself.
+static uint32_t busy_wait_count = 0;
+
+static void __attribute__((noinline)) BusyLoop(uint32_t loops) {
+  for (uint32_t i = loops; i != 0; --i) {
+    asm("");
+  }
+}
+
+// Nanoseconds the given number of busy loops take, measured with the raw
+// hardware clock that is not subject to NTP adjustments.
+static long MeasureBusyLoop(uint32_t loops) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  BusyLoop(loops);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  return DiffNanos(end, start);
+}
+
+// Determine the busy loop speed from a short and a long run; the difference
+// gives the time per iteration, the rest of the short run the fixed
+// overhead. We take the fastest of several runs, as interrupts can only ever
+// make them slower.
+static void CalibrateBusyLoop() {
+  const uint32_t kShortLoops = 1 << 10;
+  const uint32_t kLongLoops = 1 << 20;
+  long clock_nanos = -1, short_nanos = -1, long_nanos = -1;
+  for (int i = 0; i < 10; ++i) {
+    const long c = MeasureBusyLoop(0);
+    const long s = MeasureBusyLoop(kShortLoops);
+    const long l = MeasureBusyLoop(kLongLoops);
+    if (clock_nanos < 0 || c < clock_nanos) clock_nanos = c;
+    if (short_nanos < 0 || s < short_nanos) short_nanos = s;
+    if (long_nanos < 0 || l < long_nanos) long_nanos = l;
+  }
+  const long loop_nanos = long_nanos - short_nanos;
+  if (loop_nanos <= 0) return;  // Clock broken ? Keep defaults.
+  busy_loops_per_1024ns = (uint64_t)(kLongLoops - kShortLoops) * 1024
+    / loop_nanos;
+  if (busy_loops_per_1024ns == 0) busy_loops_per_1024ns = 1;
+  clock_read_nanos = clock_nanos;
+  busy_loop_overhead_nanos = short_nanos - clock_nanos
+    - (long)((uint64_t)kShortLoops * 1024 / busy_loops_per_1024ns);
+  if (busy_loop_overhead_nanos < 0) busy_loop_overhead_nanos = 0;
+}
+
+static void BusyWaitNanos(long nanos) {
+  if (nanos <= busy_loop_overhead_nanos) return;
+  const uint32_t loops = ((uint64_t)(nanos - busy_loop_overhead_nanos)
+                          * busy_loops_per_1024ns) >> 10;
+  if (nanos < BUSY_LOOP_CHECK_MIN_NANOS
+      || ++busy_wait_count % BUSY_LOOP_CHECK_INTERVAL != 0) {
+    BusyLoop(loops);
+    return;
+  }
+
+  // Check against the clock now and then to follow frequency changes. We
+  // only go part of the way towards the new measurement, as a single one
+  // might have been disturbed by an interrupt.
+  const long actual_nanos = MeasureBusyLoop(loops) - clock_read_nanos
+    - busy_loop_overhead_nanos;
+  if (actual_nanos <= 0 || loops == 0) return;
+  const int64_t measured = (uint64_t)loops * 1024 / actual_nanos;
+  const int64_t current = busy_loops_per_1024ns;
+  const int64_t corrected = current + (measured - current) / 4;
+  busy_loops_per_1024ns = corrected > 0 ? corrected : 1;
+}
 
 // By default, the kernel applies some throtteling for realtime
 // threads to prevent starvation of non-RT threads. But we
@@ -300,89 +592,84 @@ static void (*busy_sleep_impl)(long) = sleep_nanos_rpi_1;
 // our RT-thread is locked onto one of these.
 // So let's tell it not to do that.
 static void DisableRealtimeThrottling() {
-  if (!IsRaspberryPi2()) return;   // Not safe if we don't have > 1 core.
+  if (!HasMultipleCores()) return;   // Not safe if we don't have > 1 core.
   const int out = open("/proc/sys/kernel/sched_rt_runtime_us", O_WRONLY);
   if (out < 0) return;
   write(out, "-1", 2);
   close(out);
 }
 
-bool Timers::Init() {
-  const bool isRPi2 = IsRaspberryPi2();
-  uint32_t *timereg = mmap_bcm_register(isRPi2, COUNTER_1Mhz_REGISTER_OFFSET);
+// Without the timer of the Pi (e.g. when testing on another machine), the
+// microsecond counter is derived from CLOCK_MONOTONIC.
+static bool InitTimers() {
+  uint32_t *timereg = mmap_bcm_register(COUNTER_1Mhz_REGISTER_OFFSET);
+  CalibrateBusyLoop();
   if (timereg == NULL) {
-    return false;
+    return true;
   }
   timer1Mhz = timereg + 1;
-
-  busy_sleep_impl = isRPi2 ? sleep_nanos_rpi_2 : sleep_nanos_rpi_1;
-  if (isRPi2) DisableRealtimeThrottling();
+  if (HasMultipleCores()) DisableRealtimeThrottling();
   return true;
 }
 
-void Timers::sleep_nanos(long nanos) {
+bool Timers::Init() {
+  // The timer and the busy loop are shared by all pulsers, so this is only
+  // done for the first one.
+  static const bool success = InitTimers();
+  return success;
+}
+
+bool Timers::sleep_nanos(long nanos, int time_spec_number) {
   // For smaller durations, we go straight to busy wait.
 
-  // For larger duration, we use nanosleep() to give the operating system
-  // a chance to do something else.
+  // For larger duration, we sleep to give the operating system a chance to
+  // do something else.
   // However, these timings have a lot of jitter, so we do a two way
-  // approach: we use nanosleep(), but for some shorter time period so
-  // that we can tolerate some jitter (also, we need at least an offset of
-  // EMPIRICAL_NANOSLEEP_OVERHEAD_US as the nanosleep implementations on RPi
-  // actually have such offset).
-  //
-  // We use the global 1Mhz hardware timer to measure the actual time period
-  // that has passed, and then inch forward for the remaining time with
+  // approach: we sleep until some time before the deadline so that we can
+  // tolerate some jitter (the jitter allowance), then we check the actual
+  // time that has passed, and inch forward for the remaining time with
   // busy wait.
-  static long kJitterAllowanceNanos = JitterAllowanceMicroseconds() * 1000;
-  if (nanos > kJitterAllowanceNanos + 5000) {
-    const uint32_t before = *timer1Mhz;
-    struct timespec sleep_time
-      = { 0, nanos - kJitterAllowanceNanos };
-    nanosleep(&sleep_time, NULL);
-    const uint32_t after = *timer1Mhz;
-    const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
-    if (nanoseconds_passed > nanos) {
-      return;  // darn, missed it.
-    } else {
-      nanos -= nanoseconds_passed; // remaining time with busy-loop
+  const long allowance_nanos
+    = PinPulser::JitterAllowanceMicroseconds() * 1000L;
+  if (nanos > allowance_nanos + 5000) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SleepUntil(AddNanos(start, nanos - allowance_nanos), time_spec_number);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nanos -= DiffNanos(now, start);  // remaining time with busy-loop
+    if (nanos <= 0) {
+      return false;  // darn, missed it.
     }
   }
 
-  busy_sleep_impl(nanos);
-}
-
-static void sleep_nanos_rpi_1(long nanos) {
-  if (nanos < 70) return;
-  // The following loop is determined empirically on a 700Mhz RPi
-  for (uint32_t i = (nanos - 70) >> 2; i != 0; --i) {
-    asm("nop");
-  }
-}
-
-static void sleep_nanos_rpi_2(long nanos) {
-  if (nanos < 20) return;
-  // The following loop is determined empirically on a 900Mhz RPi 2
-  for (uint32_t i = (nanos - 20) * 100 / 110; i != 0; --i) {
-    asm("");
-  }
+  BusyWaitNanos(nanos);
+  return true;
 }
 
 #if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
 static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
+  fprintf(stderr, "Overshoot histogram; jitter allowance now %dus\n"
           "%6s | %7s | %7s\n",
-          JitterAllowanceMicroseconds(), "usec", "count", "accum");
-  int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
-  int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
-    const int count = overshoot_histogram_us[us];
+          PinPulser::JitterAllowanceMicroseconds(), "usec", "count", "accum");
+  uint64_t histogram[PinPulser::kOvershootBuckets] = {0};
+  uint64_t spec_histogram[PinPulser::kOvershootBuckets];
+  for (int spec = 0; PinPulser::GetOvershootHistogram(spec, spec_histogram);
+       ++spec) {
+    for (int i = 0; i < PinPulser::kOvershootBuckets; ++i)
+      histogram[i] += spec_histogram[i];
+  }
+  uint64_t total_count = 0;
+  for (int i = 0; i < PinPulser::kOvershootBuckets; ++i)
+    total_count += histogram[i];
+  uint64_t running_count = 0;
+  for (int us = 0; us < PinPulser::kOvershootBuckets; ++us) {
+    const uint64_t count = histogram[us];
     if (count > 0) {
       running_count += count;
-      fprintf(stderr, "%s%3dus: %8d %7.3f%%\n", (us == 0) ? "<=" : " +",
-              us, count, 100.0 * running_count / total_count);
+      fprintf(stderr, "%s%3dus: %8llu %7.3f%%\n", (us == 0) ? "<=" : " +",
+              us, (unsigned long long) count,
+              100.0 * running_count / total_count);
     }
   }
 }
@@ -392,7 +679,7 @@ static void print_overshoot_histogram() {
 // It only works on GPIO-18 though.
 class HardwarePinPulser : public PinPulser {
 public:
-  static bool CanHandle(uint32_t gpio_mask) {
+  static bool CanHandle(gpio_bits_t gpio_mask) {
 #ifdef DISABLE_HARDWARE_PULSES
     return false;
 #else
@@ -400,8 +687,8 @@ public:
 #endif
   }
 
-  HardwarePinPulser(uint32_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+  HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
+    : specs_(specs), triggered_(false) {
     assert(CanHandle(pins));
 #if DEBUG_SLEEP_JITTER
     atexit(print_overshoot_histogram);
@@ -420,17 +707,11 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_.push_back(specs[i] / 1000 - JitterAllowanceMicroseconds());
-    }
-
     const int base = specs[0];
     // Get relevant registers
-    const bool isPI2 = IsRaspberryPi2();
-    volatile uint32_t *gpioReg = mmap_bcm_register(isPI2, GPIO_REGISTER_OFFSET);
-    pwm_reg_  = mmap_bcm_register(isPI2, GPIO_PWM_BASE_OFFSET);
-    clk_reg_  = mmap_bcm_register(isPI2, GPIO_CLK_BASE_OFFSET);
+    volatile uint32_t *gpioReg = mmap_bcm_register(GPIO_REGISTER_OFFSET);
+    pwm_reg_  = mmap_bcm_register(GPIO_PWM_BASE_OFFSET);
+    clk_reg_  = mmap_bcm_register(GPIO_CLK_BASE_OFFSET);
     fifo_ = pwm_reg_ + PWM_FIFO;
     assert((clk_reg_ != NULL) && (pwm_reg_ != NULL));  // init error.
 
@@ -442,25 +723,26 @@ public:
   }
 
   virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      pwm_reg_[PWM_RNG1] = pwm_range_[c];
+    const uint32_t range = std::max(2L, ScaledLength(pwm_range_[c]));
+    if (range < 16) {
+      pwm_reg_[PWM_RNG1] = range;
 
-      *fifo_ = pwm_range_[c];
+      *fifo_ = range;
     } else {
       // Keep the actual range as short as possible, as we have to
       // wait for one full period of these in the zero phase.
       // The hardware can't deal with values < 2, so only do this when
       // have enough of these.
-      pwm_reg_[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
+      pwm_reg_[PWM_RNG1] = range / 8;
+
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
+      *fifo_ = range / 8;
     }
 
     /*
@@ -480,39 +762,32 @@ public:
      */
     *fifo_ = 0;
 
-    sleep_hint_ = sleep_hints_[c];
-    start_time_ = *timer1Mhz;
+    // How long to sleep, corrected for system overhead.
+    sleep_nanos_ = ScaledLength(specs_[c])
+      - JitterAllowanceMicroseconds() * 1000L;
+    if (sleep_nanos_ > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &start_time_);
+    }
+    spec_ = c;
     triggered_ = true;
     pwm_reg_[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
   }
 
   virtual void WaitPulseFinished() {
     if (!triggered_) return;
+    last_pulse_late_ = false;
     // Determine how long we already spent and sleep to get close to the
     // actual end-time of our sleep period.
     //
     // TODO(hzeller): find if it is possible to get some sort of interrupt from
     //   the hardware once it is done with the pulse. Sounds silly that there is
     //   not.
-    if (sleep_hint_ > 0) {
-      const uint32_t already_elapsed_usec = *timer1Mhz - start_time_;
-      const int to_sleep = sleep_hint_ - already_elapsed_usec;
-      if (to_sleep > 0) {
-        struct timespec sleep_time = { 0, 1000 * to_sleep };
-        nanosleep(&sleep_time, NULL);
-
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *timer1Mhz - start_time_;
-          const int nanoslept = total_us - already_elapsed_usec;
-          int overshoot = nanoslept - (to_sleep + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
-        }
-#endif
+    if (sleep_nanos_ > 0) {
+      const struct timespec wakeup = AddNanos(start_time_, sleep_nanos_);
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (DiffNanos(wakeup, now) > 0) {
+        last_pulse_late_ = SleepUntil(wakeup, spec_);
       }
     }
 
@@ -549,20 +824,21 @@ private:
   }
 
 private:
+  const std::vector<int> specs_;
   std::vector<uint32_t> pwm_range_;
-  std::vector<int> sleep_hints_;
   volatile uint32_t *pwm_reg_;
   volatile uint32_t *fifo_;
   volatile uint32_t *clk_reg_;
-  uint32_t start_time_;
-  int sleep_hint_;
+  struct timespec start_time_;
+  long sleep_nanos_;
+  int spec_;
   bool triggered_;
 };
 
 } // end anonymous namespace
 
 // Public PinPulser factory
-PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
+PinPulser *PinPulser::Create(GPIO *io, gpio_bits_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
   if (!Timers::Init()) return NULL;
@@ -574,7 +850,27 @@ PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
 }
 
 uint32_t GetMicrosecondCounter() {
-  return timer1Mhz ? *timer1Mhz : 0;
+  if (timer1Mhz) return *timer1Mhz;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Like Timers::sleep_nanos(), but towards an absolute deadline. Most of the
+// time is given back to the OS with nanosleep(); only the jitter allowance
+// before the deadline is spent busy waiting.
+void SleepUntilMicrosecondCounter(uint32_t deadline_us) {
+  const int32_t allowance_us = PinPulser::JitterAllowanceMicroseconds();
+  const int32_t remaining_us = (int32_t)(deadline_us - GetMicrosecondCounter());
+  if (remaining_us > allowance_us) {
+    const int32_t sleep_us = remaining_us - allowance_us;
+    struct timespec sleep_time = { sleep_us / 1000000,
+                                   1000 * (sleep_us % 1000000) };
+    nanosleep(&sleep_time, NULL);
+  }
+  while ((int32_t)(deadline_us - GetMicrosecondCounter()) > 0) {
+    // busy wait.
+  }
 }
 
 } // namespace rgb_matrix
@@ -19,7 +19,7 @@
  */
 #include "hardware-mapping.h"
 
-#define GPIO_BIT(b) (1<<(b))
+#define GPIO_BIT(b) ((gpio_bits_t)1<<(b))
 
 struct HardwareMapping matrix_hardware_mappings[] = {
   /*
@@ -255,5 +255,72 @@ struct HardwareMapping matrix_hardware_mappings[] = {
     .p2_b2         = GPIO_BIT(21),
   },
 
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+  /*
+   * The regular pin-out on a Compute Module, which exposes GPIO 28..45 as
+   * well. These drive three more parallel chains.
+   */
+  {
+    .name          = "compute-module",
+
+    .output_enable = GPIO_BIT(18),
+    .clock         = GPIO_BIT(17),
+    .strobe        = GPIO_BIT(4),
+
+    /* Address lines */
+    .a             = GPIO_BIT(22),
+    .b             = GPIO_BIT(23),
+    .c             = GPIO_BIT(24),
+    .d             = GPIO_BIT(25),
+    .e             = GPIO_BIT(15),
+
+    /* Chain 0..2 as in "regular" */
+    .p0_r1         = GPIO_BIT(11),
+    .p0_g1         = GPIO_BIT(27),
+    .p0_b1         = GPIO_BIT(7),
+    .p0_r2         = GPIO_BIT(8),
+    .p0_g2         = GPIO_BIT(9),
+    .p0_b2         = GPIO_BIT(10),
+
+    .p1_r1         = GPIO_BIT(12),
+    .p1_g1         = GPIO_BIT(5),
+    .p1_b1         = GPIO_BIT(6),
+    .p1_r2         = GPIO_BIT(19),
+    .p1_g2         = GPIO_BIT(13),
+    .p1_b2         = GPIO_BIT(20),
+
+    .p2_r1         = GPIO_BIT(14),
+    .p2_g1         = GPIO_BIT(2),
+    .p2_b1         = GPIO_BIT(3),
+    .p2_r2         = GPIO_BIT(26),
+    .p2_g2         = GPIO_BIT(16),
+    .p2_b2         = GPIO_BIT(21),
+
+    /* Chain 3 */
+    .p3_r1         = GPIO_BIT(28),
+    .p3_g1         = GPIO_BIT(29),
+    .p3_b1         = GPIO_BIT(30),
+    .p3_r2         = GPIO_BIT(31),
+    .p3_g2         = GPIO_BIT(32),
+    .p3_b2         = GPIO_BIT(33),
+
+    /* Chain 4 */
+    .p4_r1         = GPIO_BIT(34),
+    .p4_g1         = GPIO_BIT(35),
+    .p4_b1         = GPIO_BIT(36),
+    .p4_r2         = GPIO_BIT(37),
+    .p4_g2         = GPIO_BIT(38),
+    .p4_b2         = GPIO_BIT(39),
+
+    /* Chain 5 */
+    .p5_r1         = GPIO_BIT(40),
+    .p5_g1         = GPIO_BIT(41),
+    .p5_b1         = GPIO_BIT(42),
+    .p5_r2         = GPIO_BIT(43),
+    .p5_g2         = GPIO_BIT(44),
+    .p5_b2         = GPIO_BIT(45),
+  },
+#endif
+
   {0}
 };
@@ -81,8 +81,22 @@ struct RGBLedMatrix *led_matrix_create_from_options(
     OPT_COPY_IF_SET(led_rgb_sequence);
     OPT_COPY_IF_SET(pixel_mapper_config);
     OPT_COPY_IF_SET(inverse_colors);
+    OPT_COPY_IF_SET(adaptive_pwm);
+    OPT_COPY_IF_SET(frame_period_us);
+    OPT_COPY_IF_SET(scan_order);
+    OPT_COPY_IF_SET(pwm_slices);
+    OPT_COPY_IF_SET(pwm_dither_policy);
+    OPT_COPY_IF_SET(idle_refresh_hz);
+    OPT_COPY_IF_SET(suspend_when_black);
     OPT_COPY_IF_SET(row_address_type);
+    OPT_COPY_IF_SET(refresh_stats_file);
+    OPT_COPY_IF_SET(mapping_cache_dir);
 #undef OPT_COPY_IF_SET
+    if (opts->refresh_cpu) default_opts.realtime.cpu = opts->refresh_cpu;
+    if (opts->refresh_priority)
+      default_opts.realtime.priority = opts->refresh_priority;
+    if (opts->lock_memory) default_opts.realtime.lock_memory = true;
+    if (opts->check_isolation) default_opts.realtime.check_isolation = true;
   }
 
   rgb_matrix::RGBMatrix::Options matrix_options = default_opts;
@@ -112,8 +126,21 @@ struct RGBLedMatrix *led_matrix_create_from_options(
     ACTUAL_VALUE_BACK_TO_OPT(led_rgb_sequence);
     ACTUAL_VALUE_BACK_TO_OPT(pixel_mapper_config);
     ACTUAL_VALUE_BACK_TO_OPT(inverse_colors);
+    ACTUAL_VALUE_BACK_TO_OPT(adaptive_pwm);
+    ACTUAL_VALUE_BACK_TO_OPT(frame_period_us);
+    ACTUAL_VALUE_BACK_TO_OPT(scan_order);
+    ACTUAL_VALUE_BACK_TO_OPT(pwm_slices);
+    ACTUAL_VALUE_BACK_TO_OPT(pwm_dither_policy);
+    ACTUAL_VALUE_BACK_TO_OPT(idle_refresh_hz);
+    ACTUAL_VALUE_BACK_TO_OPT(suspend_when_black);
     ACTUAL_VALUE_BACK_TO_OPT(row_address_type);
+    ACTUAL_VALUE_BACK_TO_OPT(refresh_stats_file);
+    ACTUAL_VALUE_BACK_TO_OPT(mapping_cache_dir);
 #undef ACTUAL_VALUE_BACK_TO_OPT
+    opts->refresh_cpu = default_opts.realtime.cpu;
+    opts->refresh_priority = default_opts.realtime.priority;
+    opts->lock_memory = default_opts.realtime.lock_memory;
+    opts->check_isolation = default_opts.realtime.check_isolation;
   }
 
   rgb_matrix::RGBMatrix *matrix = CreateMatrixFromOptions(matrix_options,
@@ -155,6 +182,50 @@ struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+struct LedCanvas *led_matrix_submit_frame(struct RGBLedMatrix *matrix,
+                                          struct LedCanvas *canvas) {
+  return from_canvas(to_matrix(matrix)->SubmitFrame(to_canvas(canvas)));
+}
+
+void led_matrix_set_content_frame_rate(struct RGBLedMatrix *matrix,
+                                       double fps) {
+  to_matrix(matrix)->SetContentFrameRate(fps);
+}
+
+int led_matrix_get_vsync_fd(struct RGBLedMatrix *matrix) {
+  return to_matrix(matrix)->GetVSyncFd();
+}
+
+int led_matrix_wait_until_render_time(struct RGBLedMatrix *matrix,
+                                      int margin_us) {
+  return to_matrix(matrix)->WaitUntilRenderTime(margin_us);
+}
+
+int led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                 struct LedRefreshStats *stats) {
+  rgb_matrix::RGBMatrix::RefreshStats s;
+  if (!to_matrix(matrix)->GetRefreshStats(&s))
+    return 0;
+  stats->frames = s.frames;
+  stats->frame_us_p50 = s.frame_us_p50;
+  stats->frame_us_p99 = s.frame_us_p99;
+  stats->frame_us_p999 = s.frame_us_p999;
+  stats->frame_us_max = s.frame_us_max;
+  stats->work_us_max = s.work_us_max;
+  stats->frame_overruns = s.frame_overruns;
+  stats->late_wakeups = s.late_wakeups;
+  stats->swap_latency_us_p99 = s.swap_latency_us_p99;
+  stats->swap_latency_us_max = s.swap_latency_us_max;
+  stats->photon_latency_us_p50 = s.photon_latency_us_p50;
+  stats->photon_latency_us_p99 = s.photon_latency_us_p99;
+  stats->photon_latency_us_max = s.photon_latency_us_max;
+  stats->dropped_frames = s.dropped_frames;
+  stats->planes_shown = s.planes_shown;
+  for (int b = 0; b < rgb_matrix::RGBMatrix::RefreshStats::kPlanes; ++b)
+    stats->late_pulses[b] = s.late_pulses[b];
+  return 1;
+}
+
 void led_canvas_get_size(const struct LedCanvas *canvas,
                          int *width, int *height) {
   rgb_matrix::FrameCanvas *c = to_canvas((struct LedCanvas*)canvas);
@@ -176,6 +247,17 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b)
   to_canvas(canvas)->Fill(r, g, b);
 }
 
+void led_canvas_fill_rect(struct LedCanvas *canvas, int x, int y,
+                          int width, int height,
+                          uint8_t r, uint8_t g, uint8_t b) {
+  to_canvas(canvas)->FillRect(x, y, width, height, r, g, b);
+}
+
+void led_canvas_set_pixels(struct LedCanvas *canvas, int x, int y,
+                           int width, int height, const uint8_t *rgb) {
+  to_canvas(canvas)->SetPixels(x, y, width, height, rgb);
+}
+
 struct LedFont *load_font(const char *bdf_font_file) {
 	rgb_matrix::Font* font = new rgb_matrix::Font();
 	font->LoadFont(bdf_font_file);
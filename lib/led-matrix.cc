@@ -16,6 +16,8 @@
 #include "led-matrix.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -23,12 +25,24 @@
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
+#include "mapping-cache-internal.h"
 #include "multiplex-mappers-internal.h"
+#include "realtime-internal.h"
+#include "refresh-stats-internal.h"
+
+// Pixel mappers are applied with several threads if there are at least
+// this many pixels per thread.
+static const int kMinPixelsPerMapperThread = 16384;
 
 // Leave this in here for a while. Setting things from old defines.
 #if defined(ADAFRUIT_RGBMATRIX_HAT)
@@ -52,121 +66,783 @@ namespace rgb_matrix {
 // purposes declared here (defined in gpio.cc).
 uint32_t GetMicrosecondCounter();
 
+// Sleep until the microsecond counter reached the deadline. Mostly sleeping,
+// busy-waiting only the last few microseconds (defined in gpio.cc).
+void SleepUntilMicrosecondCounter(uint32_t deadline_us);
+
 using namespace internal;
 
+namespace {
+// Learns the frame time that covers all but the slowest 0.1% of the frames
+// seen in the last couple of minutes. That is the shortest frame period that
+// keeps the refresh steady, so this is used to auto-tune it.
+class FramePeriodTuner {
+public:
+  FramePeriodTuner()
+    : current_minute_(0), minute_start_us_(0), last_update_us_(0),
+      period_us_(0) {
+    memset(minute_histogram_, 0, sizeof(minute_histogram_));
+    memset(total_histogram_, 0, sizeof(total_histogram_));
+  }
+
+  // Record the time a frame took without any padding. Returns the currently
+  // learned frame period in microseconds; 0 while still learning.
+  int AddFrameTime(uint32_t now_us, uint32_t frame_us) {
+    const uint32_t bucket = std::min(frame_us / kBucketUs, kBuckets - 1);
+    ++minute_histogram_[current_minute_][bucket];
+    ++total_histogram_[bucket];
+
+    if (now_us - minute_start_us_ >= 60 * 1000000) {
+      // Forget the oldest minute.
+      current_minute_ = (current_minute_ + 1) % kMinutes;
+      for (uint32_t i = 0; i < kBuckets; ++i) {
+        total_histogram_[i] -= minute_histogram_[current_minute_][i];
+        minute_histogram_[current_minute_][i] = 0;
+      }
+      minute_start_us_ = now_us;
+    }
+
+    if (now_us - last_update_us_ >= 1000000) {
+      period_us_ = CalculatePercentile(999);
+      last_update_us_ = now_us;
+    }
+    return period_us_;
+  }
+
+private:
+  static const uint32_t kBucketUs = 16;
+  static const uint32_t kBuckets = 4096;  // Max period: ~65ms.
+  static const int kMinutes = 5;
+
+  // Frame time in microseconds not exceeded by "per_mille" of the frames.
+  int CalculatePercentile(int per_mille) const {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < kBuckets; ++i) count += total_histogram_[i];
+    const uint64_t target = count * per_mille / 1000;
+    uint64_t running_count = 0;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      running_count += total_histogram_[i];
+      if (running_count > target) return (i + 1) * kBucketUs;
+    }
+    return 0;
+  }
+
+  int current_minute_;
+  uint32_t minute_start_us_;
+  uint32_t last_update_us_;
+  int period_us_;
+  uint32_t minute_histogram_[kMinutes][kBuckets];
+  uint32_t total_histogram_[kBuckets];
+};
+
+// Time dithering of the lowest bitplanes. With K dither bits, the lowest
+// K+1 bitplanes all have the duration of the LSB; bitplane k < K gets its
+// weight by only being shown in 2^k of a cycle of 2^K frames.
+//
+// Which frames these are depends on the policy. "Contiguous" always shows
+// all planes above some start plane, so frames differ by up to K planes in
+// length. "Balanced" shows at most one dithered plane per frame (in the
+// sequence of a ruler: K-1, K-2, K-1, K-3, ...), so all frames have
+// about the same duration and the refresh rate does not jitter.
+class DitherSchedule {
+public:
+  DitherSchedule(int dither_bits, int policy) : position_(0) {
+    const int frames = 1 << dither_bits;
+    const uint16_t undithered = 0xffff << dither_bits;
+    for (int f = 0; f < frames; ++f) {
+      uint16_t planes;
+      if (policy == RGBMatrix::Options::kDitherContiguous) {
+        int start = 0;   // Plane k is shown in 2^k frames.
+        while ((1 << start) <= f) ++start;
+        planes = 0xffff << start;
+      } else {
+        planes = undithered;
+        if (f + 1 < frames) {
+          int trailing_zeros = 0;
+          while (((f + 1) & (1 << trailing_zeros)) == 0) ++trailing_zeros;
+          planes |= 1 << (dither_bits - 1 - trailing_zeros);
+        }
+      }
+      frame_planes_.push_back(planes);
+    }
+  }
+
+  size_t frames() const { return frame_planes_.size(); }
+
+  // Index of the frame NextFramePlanes() returns next.
+  size_t position() const { return position_; }
+
+  // Bitplanes to show in the next frame.
+  uint16_t NextFramePlanes() {
+    const uint16_t result = frame_planes_[position_];
+    if (++position_ == frame_planes_.size()) position_ = 0;
+    return result;
+  }
+
+private:
+  std::vector<uint16_t> frame_planes_;
+  size_t position_;
+};
+
+// Decides which refresh cycles start a new content frame, for a content
+// rate that is not an integer fraction of the refresh rate (e.g. 30fps at
+// 140Hz: alternating between every 4th and 5th cycle). A phase accumulator
+// over the measured cycle times puts each frame boundary on the cycle
+// closest to its ideal time, so the long-run rate is exact and the error is
+// spread evenly; changes of the refresh rate are followed automatically.
+class ContentPacer {
+public:
+  ContentPacer() : period_ns_(0), phase_ns_(0), last_check_us_(0) {}
+
+  // Returns true if the refresh cycle checked at "now_us" is a content frame
+  // boundary for frames of "period_ns".
+  bool IsBoundary(uint32_t period_ns, uint32_t now_us) {
+    const int64_t cycle_ns = 1000LL * (uint32_t)(now_us - last_check_us_);
+    last_check_us_ = now_us;
+    if (period_ns != period_ns_) {  // New rate: start right away.
+      Restart(period_ns, now_us);
+      return true;
+    }
+    phase_ns_ += cycle_ns;
+    // Is this cycle closer to the ideal boundary than the next one would be?
+    if (phase_ns_ + cycle_ns / 2 < period_ns_)
+      return false;
+    phase_ns_ -= period_ns_;
+    if (phase_ns_ > period_ns_) {
+      phase_ns_ = 0;   // Way behind, e.g. after suspend: don't catch up.
+    }
+    return true;
+  }
+
+  // Start counting from a boundary at "now_us".
+  void Restart(uint32_t period_ns, uint32_t now_us) {
+    period_ns_ = period_ns;
+    phase_ns_ = 0;
+    last_check_us_ = now_us;
+  }
+
+private:
+  uint32_t period_ns_;
+  int64_t phase_ns_;     // Time since the last ideal boundary.
+  uint32_t last_check_us_;
+};
+
+// Bounded queue between exactly one producer and one consumer thread,
+// without locks. The capacity needs to be a power of two.
+template <typename T>
+class SingleProducerQueue {
+public:
+  explicit SingleProducerQueue(uint32_t capacity)
+    : buffer_(capacity), mask_(capacity - 1), head_(0), tail_(0) {
+    assert(capacity > 0 && (capacity & mask_) == 0);
+  }
+
+  // Producer side. Returns false if full.
+  bool Push(const T &value) {
+    const uint32_t tail = tail_;
+    if (tail - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) > mask_)
+      return false;
+    buffer_[tail & mask_] = value;
+    __atomic_store_n(&tail_, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side. Look at the oldest element without removing it. Returns
+  // false if empty.
+  bool Peek(T *value) const {
+    const uint32_t head = head_;
+    if (head == __atomic_load_n(&tail_, __ATOMIC_ACQUIRE))
+      return false;
+    *value = buffer_[head & mask_];
+    return true;
+  }
+
+  // Consumer side. Remove the oldest element. Returns false if empty.
+  bool Pop(T *value) {
+    if (!Peek(value)) return false;
+    __atomic_store_n(&head_, head_ + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Can be called from either side.
+  bool empty() const {
+    return __atomic_load_n(&head_, __ATOMIC_ACQUIRE)
+      == __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+  }
+
+private:
+  std::vector<T> buffer_;
+  const uint32_t mask_;
+  uint32_t head_;   // Next to read; only written by the consumer.
+  uint32_t tail_;   // Next to write; only written by the producer.
+};
+
+// CLOCK_MONOTONIC in nanoseconds; the time base of queued frames.
+int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Frames are handed between threads without a mutex; waiting for the other
+// side uses futexes on a counter that changes with each event.
+// Waits while *word == expected, but at most timeout_ms.
+void FutexWait(uint32_t *word, uint32_t expected, long timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, &timeout, NULL, 0);
+}
+
+void FutexWakeAll(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+}  // anonymous namespace
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
-               int pwm_dither_bits, bool show_refresh)
-    : io_(io), show_refresh_(show_refresh), running_(true),
-      current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
-    switch (pwm_dither_bits) {
-    case 0:
-      start_bit_[0] = 0; start_bit_[1] = 0;
-      start_bit_[2] = 0; start_bit_[3] = 0;
-      break;
-    case 1:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 0; start_bit_[3] = 1;
-      break;
-    case 2:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 2; start_bit_[3] = 2;
-      break;
-    }
+               int pwm_dither_bits, int pwm_dither_policy,
+               bool adaptive_pwm, int frame_period_us,
+               int idle_refresh_hz, bool suspend_when_black,
+               internal::RefreshStatsCollector *stats)
+    : io_(io), adaptive_pwm_(adaptive_pwm), stats_(stats),
+      idle_period_us_(idle_refresh_hz > 0 ? 1000000 / idle_refresh_hz : 0),
+      suspend_when_black_(suspend_when_black),
+      frame_period_us_(frame_period_us),
+      dither_(pwm_dither_bits, pwm_dither_policy),
+      full_cycle_us_(dither_.frames(), 0),
+      pulse_scales_(16 * dither_.frames(), (int)PinPulser::kFullPulseScale),
+      running_(true),
+      current_frame_(initial_frame), next_frame_(NULL), submitted_frame_(0),
+      requested_frame_multiple_(1), content_period_ns_(0), vsync_count_(0), vsync_waiters_(0),
+      wakeup_count_(0), suspended_(false),
+      frame_queue_(kFrameQueueCapacity),
+      completed_frames_(2 * kFrameQueueCapacity), frames_held_(1),
+      vsync_fd_(-1), boundary_us_(0), cycle_us_(0), render_start_us_(0),
+      render_us_(0) {
+  }
+  virtual ~UpdateThread() {
+    if (vsync_fd_ >= 0) close(vsync_fd_);
   }
 
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    __atomic_store_n(&running_, false, __ATOMIC_SEQ_CST);
+    WakeUp();   // In case we are suspended.
   }
 
   virtual void Run() {
     unsigned frame_count = 0;
-    unsigned low_bit_sequence = 0;
-    uint32_t largest_time = 0;
 
-    // Let's start measure max time only after a we were running for a few
-    // seconds to not pick up start-up glitches.
-    static const int kHoldffTimeUs = 2000 * 1000;
-    uint32_t initial_holdoff_start = GetMicrosecondCounter();
-    bool max_measure_enabled = false;
+    // Content is considered static if it did not change for this long.
+    static const uint32_t kIdleHoldoffUs = 1000 * 1000;
+    const Framebuffer *last_frame = NULL;
+    uint32_t last_generation = 0;
+    uint32_t last_change_us = GetMicrosecondCounter();
+
+    uint32_t cycle = 0;
+    FrameCanvas *first_scan = NULL;   // Taken over, not shown yet.
+    ContentPacer pacer;
 
     while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
+      ++cycle;
+
+      Framebuffer *const frame = current_frame_->framebuffer();
+      if (frame != last_frame || frame->generation() != last_generation) {
+        last_frame = frame;
+        last_generation = frame->generation();
+        last_change_us = start_time_us;
+      }
+      const bool idle = (idle_period_us_ > 0
+                         && start_time_us - last_change_us > kIdleHoldoffUs);
+
+      // Adaptive PWM: the brightness of a bitplane is its pulse time's share
+      // of the refresh cycle. Without the dark low planes, the cycle gets
+      // shorter, so the pulses of the others are shortened by the same
+      // factor. That is learned relative to a full cycle, so there needs to
+      // be one first. With static content, the cycle is rather padded with
+      // dark time to a full one to spend more time sleeping.
+      const size_t dither_frame = dither_.position();
+      uint32_t *const full_cycle_us = &full_cycle_us_[dither_frame];
+      const uint16_t requested_planes = dither_.NextFramePlanes();
+      uint16_t planes = requested_planes;
+      int *pulse_scale = NULL;
+      if (adaptive_pwm_ && *full_cycle_us != 0) {
+        const int lowest_plane = frame->lowest_data_plane();
+        planes &= 0xffff << lowest_plane;
+        if (planes != requested_planes && !idle) {
+          pulse_scale = &pulse_scales_[16 * dither_frame + lowest_plane];
+        }
+      }
+      const int scale = pulse_scale ? *pulse_scale : PinPulser::kFullPulseScale;
+      uint32_t late_pulses[16] = {0};
+      const uint16_t planes_shown = frame->DumpToMatrix(io_, planes, scale,
+                                                        late_pulses);
+      const uint32_t work_time_us = GetMicrosecondCounter() - start_time_us;
+      stats_->RecordLatePulses(late_pulses);
+      if (adaptive_pwm_ && planes == requested_planes) {
+        *full_cycle_us = *full_cycle_us
+          ? (7 * *full_cycle_us + work_time_us) / 8
+          : work_time_us;
+      }
+
+      if (first_scan != NULL) {
+        // The frame taken over in the last cycle is completely on the panel.
+        FrameCanvas::Timing *const timing = &first_scan->timing_;
+        timing->live_cycle = cycle;
+        timing->live_us = start_time_us;
+        timing->scanned_us = start_time_us + work_time_us;
+        stats_->RecordPhotonLatency(timing->scanned_us - timing->submit_us);
+        first_scan = NULL;
+      }
+
+      bool resumed = false;
+      if (suspend_when_black_ && frame->is_black() && !HasPendingFrame()) {
+        resumed = SuspendWhileBlack();
+      }
+      bool new_frame_live = false;   // Boundary or frame taken over.
+
+      // With a content frame rate, the pacer decides. Otherwise, do fast
+      // equality test first (likely due to frame_count reset).
+      // After a suspend, nothing was shown, so no need to wait for vsync.
+      const unsigned frame_multiple
+        = __atomic_load_n(&requested_frame_multiple_, __ATOMIC_ACQUIRE);
+      const uint32_t content_period_ns
+        = __atomic_load_n(&content_period_ns_, __ATOMIC_RELAXED);
+      if (resumed && content_period_ns) {
+        pacer.Restart(content_period_ns, GetMicrosecondCounter());
+      }
+      if (resumed
+          || (content_period_ns
+              ? pacer.IsBoundary(content_period_ns,
+                                 start_time_us + work_time_us)
+              : (frame_count == frame_multiple
+                 || frame_count % frame_multiple == 0))) {
+        // We reset to avoid frame hick-up every couple of weeks
+        // run-time iff requested_frame_multiple_ is not a factor of 2^32.
+        frame_count = 0;
+        new_frame_live = true;
+        __atomic_store_n(&boundary_us_, resumed
+                         ? GetMicrosecondCounter()
+                         : start_time_us + work_time_us, __ATOMIC_RELEASE);
+        FrameCanvas *const next = __atomic_exchange_n(&next_frame_, NULL,
+                                                      __ATOMIC_SEQ_CST);
+        if (next != NULL) {
+          first_scan = TakeOver(next);
+        }
+        CountVSync();
+      }
+
+      // Triple buffering: show the latest submitted frame from now on; the
+      // one we had goes back to the producer.
+      if (__atomic_load_n(&submitted_frame_, __ATOMIC_ACQUIRE) & kNewFrame) {
+        const uintptr_t submitted = __atomic_exchange_n(
+          &submitted_frame_,
+          reinterpret_cast<uintptr_t>(current_frame_), __ATOMIC_ACQ_REL);
+        first_scan = TakeOver(
+          reinterpret_cast<FrameCanvas*>(submitted & ~kNewFrame));
+        new_frame_live = true;
+      }
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
-
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
+      // Frames with presentation time: switch to the latest one that is
+      // due. Due frames before it are dropped, as their time is over.
+      if (!frame_queue_.empty()) {
+        const int64_t now_ns = MonotonicNanos();
+        QueuedFrame queued;
+        FrameCanvas *due = NULL;
+        int64_t due_time_ns = 0;
+        while (frame_queue_.Peek(&queued)
+               && queued.presentation_time_ns <= now_ns) {
+          frame_queue_.Pop(&queued);
+          if (due != NULL) {
+            completed_frames_.Push(due);
+            stats_->RecordDroppedFrame();
           }
-          pthread_cond_signal(&frame_done_);
+          due = queued.frame;
+          due_time_ns = queued.presentation_time_ns;
+        }
+        if (due != NULL) {
+          completed_frames_.Push(current_frame_);
+          // Latencies count from the presentation time.
+          due->timing_.submit_us = GetMicrosecondCounter()
+            - (uint32_t)((now_ns - due_time_ns) / 1000);
+          first_scan = TakeOver(due);
+          new_frame_live = true;
         }
       }
 
+      if (new_frame_live) NotifyVSyncFd();
+
       ++frame_count;
-      ++low_bit_sequence;
 
-#ifdef FIXED_FRAME_MICROSECONDS
-      while ((GetMicrosecondCounter() - start_time_us) < (uint32_t)FIXED_FRAME_MICROSECONDS) {
-        // busy wait.
+      if (resumed) {
+        continue;  // Frame times while suspended are meaningless.
       }
-#endif
-      const uint32_t end_time_us = GetMicrosecondCounter();
-      if (show_refresh_) {
-        uint32_t usec = end_time_us - start_time_us;
-        printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-        if (usec > largest_time && max_measure_enabled) {
-          largest_time = usec;
-          printf(" max: %uusec\b\b\b\b\b\b\b\b\b\b\b\b\b\b", largest_time);
-        } else {
-          max_measure_enabled = (end_time_us - initial_holdoff_start) > kHoldffTimeUs;
+
+      // Pad the frame to the requested period, so that the occasional slow
+      // frame does not show up as a brightness fluctuation.
+      // The tuner learns the period of full cycles.
+      int frame_period_us = frame_period_us_;
+      if (frame_period_us < 0) {
+        const uint32_t full_work_us =
+          work_time_us * PinPulser::kFullPulseScale / scale;
+        frame_period_us = period_tuner_.AddFrameTime(
+          start_time_us + work_time_us, full_work_us);
+      }
+      // With static content, refresh slower to spend more time sleeping.
+      if (idle && frame_period_us < idle_period_us_) {
+        frame_period_us = idle_period_us_;
+      }
+      uint32_t padded_us = std::max((uint32_t)frame_period_us, work_time_us);
+      if (planes != requested_planes) {
+        // With the pulses at "scale", the cycle needs to be "scale" of a
+        // full one.
+        const uint32_t full_us = std::max((uint32_t)frame_period_us,
+                                          *full_cycle_us);
+        padded_us = std::max(work_time_us,
+                             full_us * scale / PinPulser::kFullPulseScale);
+        if (pulse_scale != NULL) {
+          // The work gets less with the scale, so starting from the full
+          // length, the scale goes down to where the work fills the cycle
+          // (but for some headroom against jitter). Every cycle on the way
+          // is padded to exactly its length.
+          const uint32_t needed_us = work_time_us + work_time_us / 16;
+          int next_scale =
+            (needed_us * PinPulser::kFullPulseScale + full_us - 1) / full_us;
+          if (next_scale > PinPulser::kFullPulseScale)
+            next_scale = PinPulser::kFullPulseScale;
+          if (next_scale < kMinPulseScale)
+            next_scale = kMinPulseScale;
+          *pulse_scale = next_scale;
         }
       }
+      if (padded_us > work_time_us) {
+        SleepUntilMicrosecondCounter(start_time_us + padded_us);
+      }
+
+      // No I/O in here: the reporter thread takes care of printing.
+      const uint32_t frame_us = GetMicrosecondCounter() - start_time_us;
+      stats_->RecordFrame(start_time_us, frame_us,
+                          work_time_us, frame_period_us, planes_shown, idle);
+
+      // Moving average for predicting the next boundary.
+      const uint32_t cycle_us = __atomic_load_n(&cycle_us_, __ATOMIC_RELAXED);
+      __atomic_store_n(&cycle_us_,
+                       cycle_us ? (7 * cycle_us + frame_us) / 8 : frame_us,
+                       __ATOMIC_RELAXED);
     }
   }
 
+  // Wait until the refresh thread reaches the next frame boundary that
+  // satisfies "frame_fraction" and swaps in "other" (if not NULL).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
+    FrameCanvas *previous = __atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&requested_frame_multiple_, frame_fraction,
+                     __ATOMIC_RELEASE);
+    const uint32_t start_count = __atomic_load_n(&vsync_count_,
+                                                 __ATOMIC_SEQ_CST);
+    if (other) {
+      StartTiming(other);
+      __atomic_store_n(&next_frame_, other, __ATOMIC_SEQ_CST);
+    }
+    WakeUp();   // In case we are suspended.
+
+    // The refresh thread first takes the frame, then counts the vsync; so
+    // re-checking after reading the count does not miss the wake-up.
+    __atomic_add_fetch(&vsync_waiters_, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      const uint32_t count = __atomic_load_n(&vsync_count_, __ATOMIC_SEQ_CST);
+      const bool done = other
+        ? __atomic_load_n(&next_frame_, __ATOMIC_SEQ_CST) == NULL
+        : count != start_count;
+      if (done || !running()) break;
+      FutexWait(&vsync_count_, count, kPollIntervalMs);
+    }
+    __atomic_sub_fetch(&vsync_waiters_, 1, __ATOMIC_SEQ_CST);
     return previous;
   }
 
+  // Publish "frame" to be shown from the next frame boundary on, without
+  // waiting. Returns a frame no longer in use: either one that was
+  // submitted before but never got to be shown, or the one just replaced on
+  // the screen. Returns NULL the very first time.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame) {
+    StartTiming(frame);
+    const uintptr_t previous = __atomic_exchange_n(
+      &submitted_frame_, reinterpret_cast<uintptr_t>(frame) | kNewFrame,
+      __ATOMIC_ACQ_REL);
+    WakeUp();   // In case we are suspended.
+    return reinterpret_cast<FrameCanvas*>(previous & ~kNewFrame);
+  }
+
+  // Queue "frame" to be shown at "presentation_time_ns". Returns false if
+  // there are already kFrameQueueCapacity frames queued or not collected
+  // with GetCompletedFrame().
+  bool QueueFrame(FrameCanvas *frame, int64_t presentation_time_ns) {
+    if (frames_held_ > kFrameQueueCapacity)   // One of them is on screen.
+      return false;
+    StartTiming(frame);
+    QueuedFrame queued;
+    queued.frame = frame;
+    queued.presentation_time_ns = presentation_time_ns;
+    if (!frame_queue_.Push(queued))
+      return false;
+    ++frames_held_;
+    WakeUp();   // In case we are suspended.
+    return true;
+  }
+
+  // A frame that was replaced on the screen or dropped; NULL if none.
+  FrameCanvas *GetCompletedFrame() {
+    FrameCanvas *result;
+    if (!completed_frames_.Pop(&result))
+      return NULL;
+    --frames_held_;
+    return result;
+  }
+
+  // Sleep until the render time before the next boundary that can still be
+  // made. Returns the microseconds left until that boundary.
+  int WaitUntilRenderTime(int margin_us) {
+    const uint32_t cycle_us = __atomic_load_n(&cycle_us_, __ATOMIC_RELAXED);
+    const uint32_t content_period_ns
+      = __atomic_load_n(&content_period_ns_, __ATOMIC_RELAXED);
+    const uint32_t period_us = (cycle_us && content_period_ns)
+      ? content_period_ns / 1000
+      : cycle_us * __atomic_load_n(&requested_frame_multiple_,
+                                   __ATOMIC_RELAXED);
+    uint32_t now_us = GetMicrosecondCounter();
+    if (period_us == 0) {   // No refresh yet to predict from.
+      render_start_us_ = now_us;
+      return 0;
+    }
+    const uint32_t lead_us = render_us_ + margin_us;
+    uint32_t boundary_us = __atomic_load_n(&boundary_us_, __ATOMIC_ACQUIRE)
+      + period_us;
+    if ((int32_t)(boundary_us - lead_us - now_us) < 0) {
+      // Too late for that one (or the refresh was suspended): next one in
+      // the future that we can still make.
+      const uint32_t behind_us = now_us + lead_us - boundary_us;
+      boundary_us += (behind_us / period_us + 1) * period_us;
+    }
+    const int32_t sleep_us = (int32_t)(boundary_us - lead_us - now_us);
+    if (sleep_us > 0) {
+      struct timespec sleep_time = { sleep_us / 1000000,
+                                     1000 * (sleep_us % 1000000) };
+      nanosleep(&sleep_time, NULL);
+      now_us = GetMicrosecondCounter();
+    }
+    render_start_us_ = now_us;
+    return (int32_t)(boundary_us - now_us);
+  }
+
+  // A frame is handed over: learn how long rendering took since
+  // WaitUntilRenderTime(). Goes up right away, but comes down slowly, so
+  // that the occasional slower frame does not miss its boundary again.
+  void RenderDone() {
+    if (render_start_us_ == 0) return;
+    const uint32_t render_us = GetMicrosecondCounter() - render_start_us_;
+    render_start_us_ = 0;
+    if (render_us > kMaxRenderUs) return;  // Not a render after waiting.
+    if (render_us > render_us_) {
+      render_us_ = render_us;
+    } else {
+      render_us_ -= (render_us_ - render_us) / 16;
+    }
+  }
+
+  // Create the eventfd that is signaled at frame boundaries, or return the
+  // one created before.
+  int GetVSyncFd() {
+    int fd = __atomic_load_n(&vsync_fd_, __ATOMIC_ACQUIRE);
+    if (fd >= 0) return fd;
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+      perror("Can't create vsync eventfd");
+      return -1;
+    }
+    int expected = -1;
+    if (!__atomic_compare_exchange_n(&vsync_fd_, &expected, fd, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      close(fd);   // Someone else was faster.
+      return expected;
+    }
+    return fd;
+  }
+
+  // Content frames per second for SwapOnVSync(); 0 = use frame fraction.
+  void SetContentFrameRate(double fps) {
+    __atomic_store_n(&content_period_ns_,
+                     fps > 0 ? (uint32_t)(1e9 / fps + 0.5) : 0,
+                     __ATOMIC_RELAXED);
+  }
+
+  // Microseconds per frame; 0 = as fast as possible, negative = auto-tune.
+  void SetFramePeriod(int usec) { frame_period_us_ = usec; }
+
 private:
+  // Low bit of submitted_frame_: not shown yet.
+  static const uintptr_t kNewFrame = 1;
+  static const long kPollIntervalMs = 10;
+  static const uint32_t kFrameQueueCapacity = 16;
+  static const uint32_t kMaxRenderUs = 1000000;
+
+  struct QueuedFrame {
+    FrameCanvas *frame;
+    int64_t presentation_time_ns;
+  };
+
   inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+    return __atomic_load_n(&running_, __ATOMIC_SEQ_CST);
+  }
+
+  bool HasNewFrame() {
+    return __atomic_load_n(&next_frame_, __ATOMIC_SEQ_CST) != NULL
+      || (__atomic_load_n(&submitted_frame_, __ATOMIC_SEQ_CST) & kNewFrame);
+  }
+
+  // A frame boundary passed: let the SwapOnVSync() waiters know.
+  void CountVSync() {
+    __atomic_add_fetch(&vsync_count_, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&vsync_waiters_, __ATOMIC_SEQ_CST) > 0) {
+      FutexWakeAll(&vsync_count_);
+    }
+  }
+
+  // Make the vsync eventfd readable, if anyone asked for it. Non-blocking;
+  // the counter just goes up if the reader is behind.
+  void NotifyVSyncFd() {
+    const int fd = __atomic_load_n(&vsync_fd_, __ATOMIC_ACQUIRE);
+    if (fd < 0) return;
+    const uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+      // Only if the counter overflows; nothing to do.
+    }
+  }
+
+  // Producer: "frame" is handed over now. Published to the refresh thread
+  // with the hand-over.
+  static void StartTiming(FrameCanvas *frame) {
+    frame->timing_ = FrameCanvas::Timing();
+    frame->timing_.submit_us = GetMicrosecondCounter();
   }
 
+  // Refresh thread: show "frame" from the next cycle on. Returns it to be
+  // timestamped once it is on the panel.
+  FrameCanvas *TakeOver(FrameCanvas *frame) {
+    __atomic_store_n(&current_frame_, frame, __ATOMIC_RELEASE);
+    stats_->RecordSwapLatency(GetMicrosecondCounter()
+                              - frame->timing_.submit_us);
+    return frame;
+  }
+
+  // A new frame or one that will become due.
+  bool HasPendingFrame() {
+    return HasNewFrame() || !frame_queue_.empty();
+  }
+
+  // Wake up the refresh thread if it is suspended.
+  void WakeUp() {
+    __atomic_add_fetch(&wakeup_count_, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&suspended_, __ATOMIC_SEQ_CST)) {
+      FutexWakeAll(&wakeup_count_);
+    }
+  }
+
+  // Called after showing a completely black frame: the LEDs stay dark
+  // without refresh, so wait until there is something to show. A new frame
+  // wakes us up right away; drawing directly into the current frame is
+  // noticed within the poll interval.
+  // Meanwhile, there is a frame boundary every poll interval, so that
+  // SwapOnVSync(NULL), the vsync eventfd and WaitUntilRenderTime() keep a
+  // pace (if slower) and nobody waits for a boundary forever.
+  // Returns true once there is something to show.
+  bool SuspendWhileBlack() {
+    __atomic_store_n(&suspended_, true, __ATOMIC_SEQ_CST);
+    uint32_t boundary_us = GetMicrosecondCounter();
+    for (;;) {
+      const uint32_t wakeups = __atomic_load_n(&wakeup_count_,
+                                               __ATOMIC_SEQ_CST);
+      if (HasPendingFrame() || !current_frame_->framebuffer()->is_black())
+        break;
+      if (!running()) {
+        __atomic_store_n(&suspended_, false, __ATOMIC_SEQ_CST);
+        return false;
+      }
+      const uint32_t now_us = GetMicrosecondCounter();
+      uint32_t since_boundary_us = now_us - boundary_us;
+      if (since_boundary_us >= kPollIntervalMs * 1000) {
+        boundary_us = now_us;
+        since_boundary_us = 0;
+        __atomic_store_n(&boundary_us_, now_us, __ATOMIC_RELEASE);
+        CountVSync();
+        NotifyVSyncFd();
+      }
+      // Wake-ups in between don't delay the next boundary.
+      FutexWait(&wakeup_count_, wakeups,
+                kPollIntervalMs - since_boundary_us / 1000);
+    }
+    __atomic_store_n(&suspended_, false, __ATOMIC_SEQ_CST);
+    return true;
+  }
+
+  // Adaptive PWM does not shorten pulses further, as the hardware pulser
+  // can't make them arbitrarily short.
+  static const int kMinPulseScale = PinPulser::kFullPulseScale / 16;
+
   GPIO *const io_;
-  const bool show_refresh_;
-  uint32_t start_bit_[4];
-  Mutex running_mutex_;
+  const bool adaptive_pwm_;
+  internal::RefreshStatsCollector *const stats_;
+  const int idle_period_us_;
+  const bool suspend_when_black_;
+  volatile int frame_period_us_;
+  FramePeriodTuner period_tuner_;
+  DitherSchedule dither_;
+  // Adaptive PWM: average time sending all bitplanes, per dither frame, and
+  // the pulse scale per dither frame and lowest bitplane shown.
+  std::vector<uint32_t> full_cycle_us_;
+  std::vector<int> pulse_scales_;
   bool running_;
 
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
+  // Frame hand-over. All of these are shared with the producer thread(s) and
+  // only accessed atomically.
+  FrameCanvas *current_frame_;     // Written by refresh thread only.
+  FrameCanvas *next_frame_;        // From SwapOnVSync().
+  uintptr_t submitted_frame_;      // From SubmitFrame(), plus kNewFrame bit.
   unsigned requested_frame_multiple_;
+  uint32_t content_period_ns_;     // 0: use requested_frame_multiple_.
+  uint32_t vsync_count_;           // Futex: frame boundaries passed.
+  uint32_t vsync_waiters_;
+  uint32_t wakeup_count_;          // Futex: wakes up from suspend.
+  bool suspended_;
+
+  // Frames with presentation time, and the ones done with.
+  SingleProducerQueue<QueuedFrame> frame_queue_;
+  SingleProducerQueue<FrameCanvas*> completed_frames_;
+  // Frames on screen, queued or completed but not collected yet; producer
+  // only. Limits the frames that can be in the completion queue.
+  uint32_t frames_held_;
+
+  int vsync_fd_;                   // eventfd; -1 until asked for.
+
+  // Just-in-time rendering: when the refresh thread took the last frame,
+  // and the average refresh cycle; both written by the refresh thread.
+  // The render times are producer only.
+  uint32_t boundary_us_;
+  uint32_t cycle_us_;
+  uint32_t render_start_us_;
+  uint32_t render_us_;
 };
 
+// Stack the refresh thread gets pre-faulted with --led-lock-memory.
+static const size_t kRefreshStackPrefault = 64 << 10;
+
+RealtimeOptions::RealtimeOptions()
+  : cpu(-1), priority(99), lock_memory(false), check_isolation(false) {
+}
+
 // Some defaults. See options-initialize.cc for the command line parsing.
 RGBMatrix::Options::Options() :
   // Historically, we provided these options only as #defines. Make sure that
@@ -187,6 +863,8 @@ RGBMatrix::Options::Options() :
 #endif
 
   pwm_dither_bits(0),
+  pwm_dither_policy(kDitherBalanced),
+  pwm_slices(1),
   brightness(100),
 
 #ifdef RGB_SCAN_INTERLACED
@@ -194,10 +872,18 @@ RGBMatrix::Options::Options() :
 #else
     scan_mode(0),
 #endif
+  scan_order(NULL),
 
   row_address_type(0),
   multiplexing(0),
 
+#ifdef FIXED_FRAME_MICROSECONDS
+    frame_period_us(FIXED_FRAME_MICROSECONDS),
+#else
+    frame_period_us(0),
+#endif
+  idle_refresh_hz(0),
+
 #ifdef DISABLE_HARDWARE_PULSES
     disable_hardware_pulsing(true),
 #else
@@ -209,20 +895,26 @@ RGBMatrix::Options::Options() :
 #else
     show_refresh_rate(false),
 #endif
+  refresh_stats_file(NULL),
 
 #ifdef INVERSE_RGB_DISPLAY_COLORS
     inverse_colors(true),
 #else
     inverse_colors(false),
 #endif
+  adaptive_pwm(false),
+  suspend_when_black(false),
   led_rgb_sequence("RGB"),
-  pixel_mapper_config(NULL)
+  pixel_mapper_config(NULL),
+  mapping_cache_dir(NULL)
 {
   // Nothing to see here.
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(options), io_(NULL), owned_io_(NULL), hardware_(NULL),
+    updater_(NULL), refresh_stats_(NULL),
+    stats_reporter_(NULL), shared_pixel_mapper_(NULL) {
   assert(params_.Validate(NULL));
   const MultiplexMapper *multiplex_mapper = NULL;
   if (params_.multiplexing > 0) {
@@ -239,45 +931,74 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
     multiplex_mapper->EditColsRows(&params_.cols, &params_.rows);
   }
 
-  Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  hardware_ = new internal::PanelHardware(params_.hardware_mapping);
+  const internal::MappingCache mapping_cache(
+    params_.mapping_cache_dir, params_, hardware_->mapping(),
+    Framebuffer::GpioWords(params_.rows, params_.cols * params_.chain_length));
+  shared_pixel_mapper_ = mapping_cache.Load();
+  const bool mapping_cached = (shared_pixel_mapper_ != NULL);
+
   active_ = CreateFrameCanvas();
   Clear();
   SetGPIO(io, true);
 
+  if (mapping_cached)
+    return;
+
   // We need to apply the mapping for the panels first.
   ApplyPixelMapper(multiplex_mapper);
 
   // .. followed by higher level mappers that might arrange panels.
   ApplyNamedPixelMappers(options.pixel_mapper_config,
                          params_.chain_length, params_.parallel);
+
+  mapping_cache.Store(*shared_pixel_mapper_);
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : params_(Options()), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(Options()), io_(NULL), owned_io_(NULL), hardware_(NULL),
+    updater_(NULL), refresh_stats_(NULL),
+    stats_reporter_(NULL), shared_pixel_mapper_(NULL) {
   params_.rows = rows;
   params_.chain_length = chained_displays;
   params_.parallel = parallel_displays;
   assert(params_.Validate(NULL));
-  Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  hardware_ = new internal::PanelHardware(params_.hardware_mapping);
   active_ = CreateFrameCanvas();
   Clear();
   SetGPIO(io, true);
 }
 
 RGBMatrix::~RGBMatrix() {
-  updater_->Stop();
-  updater_->WaitStopped();
-  delete updater_;
+  if (updater_) {
+    updater_->Stop();
+    updater_->WaitStopped();
+    delete updater_;
+  }
+
+  if (stats_reporter_) {
+    stats_reporter_->Stop();
+    stats_reporter_->WaitStopped();
+    delete stats_reporter_;
+  }
+  delete refresh_stats_;
 
   // Make sure LEDs are off.
-  active_->Clear();
-  active_->framebuffer()->DumpToMatrix(io_, 0);
+  if (io_) {
+    active_->Clear();
+    uint32_t late_pulses[16];
+    active_->framebuffer()->DumpToMatrix(io_, 0xffff,   // All bitplanes.
+                                         PinPulser::kFullPulseScale,
+                                         late_pulses);
+  }
+  delete owned_io_;
 
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
   }
   delete shared_pixel_mapper_;
+  delete hardware_;
 }
 
 void RGBMatrix::ApplyNamedPixelMappers(const char *pixel_mapper_config,
@@ -306,12 +1027,15 @@ void RGBMatrix::ApplyNamedPixelMappers(const char *pixel_mapper_config,
 }
 
 void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
-  if (io != NULL && io_ == NULL) {
+  if (io != NULL && io_ == NULL
+      && hardware_->InitGPIO(io, params_.rows, params_.parallel,
+                             !params_.disable_hardware_pulsing,
+                             params_.pwm_lsb_nanoseconds,
+                             params_.pwm_dither_bits,
+                             params_.row_address_type,
+                             params_.scan_mode, params_.scan_order,
+                             params_.pwm_slices)) {
     io_ = io;
-    Framebuffer::InitGPIO(io_, params_.rows, params_.parallel,
-                          !params_.disable_hardware_pulsing,
-                          params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
-                          params_.row_address_type);
   }
   if (start_thread) {
     StartRefresh();
@@ -320,26 +1044,45 @@ void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
+    refresh_stats_ = new internal::RefreshStatsCollector();
     updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
-                                params_.show_refresh_rate);
+                                params_.pwm_dither_policy,
+                                params_.adaptive_pwm,
+                                params_.frame_period_us,
+                                params_.idle_refresh_hz,
+                                params_.suspend_when_black,
+                                refresh_stats_);
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
-    // So let's tie it to the last CPU available.
-    // The Raspberry Pi2 has 4 cores, our attempt to bind it to
-    //   core #3 will succeed.
-    // The Raspberry Pi1 only has one core, so this affinity
-    //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    // So let's tie it to one CPU, by default the last one available.
+    const RealtimeOptions &rt = params_.realtime;
+    const int cpu = (rt.cpu < 0) ? internal::LastCpu() : rt.cpu;
+    if (rt.lock_memory && internal::LockMemory()) {
+      updater_->set_stack_prefault(kRefreshStackPrefault);
+    }
+    if (rt.check_isolation) {
+      internal::ReportCpuIsolation(cpu, stderr);
+    }
+    updater_->set_name("led-refresh");
+    updater_->Start(rt.priority, 1 << cpu);
+
+    if (params_.show_refresh_rate || params_.refresh_stats_file) {
+      stats_reporter_ = new internal::RefreshStatsReporter(
+        refresh_stats_, params_.show_refresh_rate,
+        params_.adaptive_pwm || params_.pwm_dither_bits > 0,
+        params_.refresh_stats_file);
+      stats_reporter_->set_name("led-stats");
+      stats_reporter_->Start();   // Regular priority.
+    }
   }
   return updater_ != NULL;
 }
 
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   FrameCanvas *result =
-    new FrameCanvas(new Framebuffer(params_.rows,
+    new FrameCanvas(new Framebuffer(hardware_, params_.rows,
                                     params_.cols * params_.chain_length,
                                     params_.parallel,
-                                    params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
                                     &shared_pixel_mapper_));
@@ -359,11 +1102,66 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
+  if (other && params_.adaptive_pwm) {
+    // The frame is complete now: find the bitplanes it really needs.
+    other->framebuffer()->UpdatePlaneOccupancy();
+  }
+  if (updater_ == NULL) {   // Nothing to wait for without refresh.
+    FrameCanvas *const previous = active_;
+    if (other) active_ = other;
+    return previous;
+  }
+  if (other) updater_->RenderDone();
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
   if (other) active_ = other;
   return previous;
 }
 
+void RGBMatrix::SetContentFrameRate(double fps) {
+  if (updater_) updater_->SetContentFrameRate(fps);
+}
+
+int RGBMatrix::WaitUntilRenderTime(int margin_us) {
+  return updater_ ? updater_->WaitUntilRenderTime(margin_us) : 0;
+}
+
+int RGBMatrix::GetVSyncFd() {
+  return updater_ ? updater_->GetVSyncFd() : -1;
+}
+
+bool RGBMatrix::QueueFrame(FrameCanvas *frame, int64_t presentation_time_ns) {
+  if (params_.adaptive_pwm) {
+    frame->framebuffer()->UpdatePlaneOccupancy();
+  }
+  if (updater_ == NULL || !updater_->QueueFrame(frame, presentation_time_ns))
+    return false;
+  active_ = frame;
+  return true;
+}
+
+FrameCanvas *RGBMatrix::GetCompletedFrame() {
+  return updater_ ? updater_->GetCompletedFrame() : NULL;
+}
+
+FrameCanvas *RGBMatrix::SubmitFrame(FrameCanvas *frame) {
+  if (params_.adaptive_pwm) {
+    frame->framebuffer()->UpdatePlaneOccupancy();
+  }
+  FrameCanvas *free_frame;
+  if (updater_) {
+    updater_->RenderDone();
+    free_frame = updater_->SubmitFrame(frame);
+  } else {
+    free_frame = (active_ != frame) ? active_ : NULL;
+  }
+  active_ = frame;
+  if (free_frame == NULL) {
+    // First time: the third buffer.
+    free_frame = CreateFrameCanvas();
+  }
+  return free_frame;
+}
+
 bool RGBMatrix::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
@@ -393,6 +1191,21 @@ uint8_t RGBMatrix::brightness() {
   return params_.brightness;
 }
 
+void RGBMatrix::SetFramePeriod(int usec) {
+  params_.frame_period_us = usec;
+  if (updater_) updater_->SetFramePeriod(usec);
+}
+
+int RGBMatrix::frame_period() {
+  return params_.frame_period_us;
+}
+
+bool RGBMatrix::GetRefreshStats(RefreshStats *stats) const {
+  if (refresh_stats_ == NULL) return false;
+  refresh_stats_->Fill(stats);
+  return true;
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
   return active_->width();
@@ -414,19 +1227,16 @@ void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   active_->Fill(red, green, blue);
 }
 
-bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
-  if (mapper == NULL) return true;
-  using internal::PixelDesignatorMap;
-  const int old_width = shared_pixel_mapper_->width();
-  const int old_height = shared_pixel_mapper_->height();
-  int new_width, new_height;
-  if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height)) {
-    return false;
-  }
-  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(new_width,
-                                                          new_height);
-  for (int y = 0; y < new_height; ++y) {
-    for (int x = 0; x < new_width; ++x) {
+// Fill rows [y_begin, y_end) of "new_map" with the designators of "old_map"
+// as arranged by "mapper".
+static void MapDesignatorRows(const PixelMapper *mapper,
+                              internal::PixelDesignatorMap *old_map,
+                              internal::PixelDesignatorMap *new_map,
+                              int y_begin, int y_end) {
+  const int old_width = old_map->width();
+  const int old_height = old_map->height();
+  for (int y = y_begin; y < y_end; ++y) {
+    for (int x = 0; x < new_map->width(); ++x) {
       int orig_x = -1, orig_y = -1;
       mapper->MapVisibleToMatrix(old_width, old_height,
                                  x, y, &orig_x, &orig_y);
@@ -436,11 +1246,68 @@ bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
                 "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
         continue;
       }
-      const internal::PixelDesignator *orig_designator;
-      orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-      *new_mapper->get(x, y) = *orig_designator;
+      *new_map->get(x, y) = *old_map->get(orig_x, orig_y);
     }
   }
+}
+
+namespace {
+// Takes on a share of the rows in ApplyPixelMapper().
+class MapDesignatorRowsThread : public Thread {
+public:
+  MapDesignatorRowsThread(const PixelMapper *mapper,
+                          internal::PixelDesignatorMap *old_map,
+                          internal::PixelDesignatorMap *new_map,
+                          int y_begin, int y_end)
+    : mapper_(mapper), old_map_(old_map), new_map_(new_map),
+      y_begin_(y_begin), y_end_(y_end) {}
+
+  virtual void Run() {
+    MapDesignatorRows(mapper_, old_map_, new_map_, y_begin_, y_end_);
+  }
+
+private:
+  const PixelMapper *const mapper_;
+  internal::PixelDesignatorMap *const old_map_;
+  internal::PixelDesignatorMap *const new_map_;
+  const int y_begin_;
+  const int y_end_;
+};
+}  // anonymous namespace
+
+bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
+  if (mapper == NULL) return true;
+  using internal::PixelDesignatorMap;
+  const int old_width = shared_pixel_mapper_->width();
+  const int old_height = shared_pixel_mapper_->height();
+  int new_width, new_height;
+  if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height)) {
+    return false;
+  }
+  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
+    new_width, new_height, *shared_pixel_mapper_);
+
+  // Large maps are split into bands of rows done in parallel; this thread
+  // does the first.
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const int threads = std::max(1, std::min<int>(
+    cpus, new_width * new_height / kMinPixelsPerMapperThread));
+  std::vector<Thread*> helpers;
+  for (int i = 1; i < threads; ++i) {
+    Thread *helper = new MapDesignatorRowsThread(
+      mapper, shared_pixel_mapper_, new_mapper,
+      new_height * i / threads, new_height * (i + 1) / threads);
+    helper->Start();
+    helpers.push_back(helper);
+  }
+  MapDesignatorRows(mapper, shared_pixel_mapper_, new_mapper,
+                    0, new_height / threads);
+  for (size_t i = 0; i < helpers.size(); ++i) {
+    helpers[i]->WaitStopped();
+    delete helpers[i];
+  }
+  new_mapper->CompileRuns();
+
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
   return true;
@@ -505,7 +1372,8 @@ void RGBMatrix::ApplyStaticTransformerDeprecated(
 
   const int new_width = mapped_canvas->width();
   const int new_height = mapped_canvas->height();
-  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(new_width, new_height);
+  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
+    new_width, new_height, *shared_pixel_mapper_);
   extractor_canvas.SetNewMapper(new_mapper);
   // Learn about the pixel mapping by going through all transformed pixels and
   // build new PixelDesignator map.
@@ -515,6 +1383,7 @@ void RGBMatrix::ApplyStaticTransformerDeprecated(
       mapped_canvas->SetPixel(x, y, 0, 0, 0); // force copy of designator.
     }
   }
+  new_mapper->CompileRuns();
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
 }
@@ -532,6 +1401,14 @@ void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb) {
+  frame_->SetPixels(x, y, width, height, rgb);
+}
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
 
@@ -0,0 +1,58 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_RGBMATRIX_MAPPING_CACHE_INTERNAL_H
+#define RPI_RGBMATRIX_MAPPING_CACHE_INTERNAL_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "framebuffer-internal.h"
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+namespace internal {
+
+// Keeps the final PixelDesignatorMap of a matrix configuration in a file, so
+// that the next start can mmap() it instead of calculating it again. The
+// file name contains a hash of everything the mapping depends on; the file
+// itself the full description, so that a hash collision is noticed.
+//
+// Pixel mappers that are registered by the program itself are only known by
+// their name: if their code changes, the cache needs to be removed.
+class MappingCache {
+public:
+  // Cache in directory "dir"; NULL means no caching. The multiplexer needs
+  // to be applied to "options" already, "gpio_words" is the size of the
+  // Framebuffer (see Framebuffer::GpioWords()).
+  MappingCache(const char *dir, const RGBMatrix::Options &options,
+               const HardwareMapping &hardware, int gpio_words);
+
+  // Returns the cached map, or NULL if there is none that fits.
+  PixelDesignatorMap *Load() const;
+
+  // Store "map" for the next start. Prints a note if that is not possible.
+  void Store(const PixelDesignatorMap &map) const;
+
+private:
+  std::string filename_;     // Empty if not caching.
+  std::string description_;
+  const int gpio_words_;
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_MAPPING_CACHE_INTERNAL_H
@@ -0,0 +1,190 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "mapping-cache-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace rgb_matrix {
+namespace internal {
+
+// Changes whenever the file layout or the meaning of PixelDesignators does.
+static const char kMagic[8] = "RGBMAP1";
+
+// The file: header, description (padded to kAlign), color bits, then the
+// designators row by row.
+struct CacheHeader {
+  char magic[8];
+  uint32_t description_size;   // Including padding.
+  uint32_t color_count;
+  int32_t width;
+  int32_t height;
+  uint64_t checksum;           // Of everything after the header.
+};
+
+static const size_t kAlign = 8;
+
+static size_t Padded(size_t size) { return (size + kAlign - 1) & ~(kAlign-1); }
+
+static const uint64_t kHashStart = 0xcbf29ce484222325ULL;
+
+// 64 bit FNV-1a, continuing from "hash".
+static uint64_t Hash(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t*) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static const char *OrEmpty(const char *s) { return s ? s : ""; }
+
+MappingCache::MappingCache(const char *dir, const RGBMatrix::Options &options,
+                           const HardwareMapping &hardware, int gpio_words)
+  : gpio_words_(gpio_words) {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "rows=%d cols=%d chain=%d parallel=%d multiplexing=%d "
+           "gpio_words=%d gpio_bits=%d hardware=%s",
+           options.rows, options.cols, options.chain_length, options.parallel,
+           options.multiplexing, gpio_words, (int)sizeof(gpio_bits_t) * 8,
+           hardware.name);
+  description_ = buffer;
+  description_.append(" led_sequence=").append(
+    OrEmpty(options.led_rgb_sequence));
+  description_.append(" pixel_mapper=").append(
+    OrEmpty(options.pixel_mapper_config));
+
+  if (dir == NULL || *dir == '\0') return;
+  snprintf(buffer, sizeof(buffer), "/led-mapping-%016llx.cache",
+           (unsigned long long) Hash(kHashStart, description_.data(),
+                                     description_.size()));
+  filename_ = std::string(dir) + buffer;
+}
+
+PixelDesignatorMap *MappingCache::Load() const {
+  if (filename_.empty()) return NULL;
+  const int fd = open(filename_.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;   // Not cached yet.
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheHeader)) {
+    // Private and writable: the map can be changed by later pixel mappers
+    // without touching the file.
+    mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+  const size_t size = st.st_size;
+
+  // Check that the file is complete and describes our configuration.
+  const char *const data = (const char*) mapping;
+  const CacheHeader *const header = (const CacheHeader*) data;
+  const size_t colors_offset = sizeof(CacheHeader) + header->description_size;
+  const size_t designators_offset = colors_offset
+    + (size_t)header->color_count * sizeof(PixelColorBits);
+  bool valid = (memcmp(header->magic, kMagic, sizeof(kMagic)) == 0
+                && header->description_size == Padded(description_.size() + 1)
+                && header->color_count <= PixelDesignator::kMaxColorIndex + 1
+                && header->width > 0 && header->height > 0
+                && size == designators_offset + (size_t)header->width
+                * header->height * sizeof(PixelDesignator)
+                && strcmp(data + sizeof(CacheHeader),
+                          description_.c_str()) == 0
+                && header->checksum == Hash(kHashStart,
+                                            data + sizeof(CacheHeader),
+                                            size - sizeof(CacheHeader)));
+
+  // Never trust a designator to point outside the framebuffer.
+  PixelDesignator *const designators
+    = (PixelDesignator*)(data + designators_offset);
+  const int count = valid ? header->width * header->height : 0;
+  for (int i = 0; i < count && valid; ++i) {
+    const PixelDesignator &d = designators[i];
+    valid = !d.is_used() || (d.gpio_word() < gpio_words_
+                             && d.color_index() < (int)header->color_count);
+  }
+  if (!valid) {
+    fprintf(stderr, "FYI: Ignoring outdated pixel mapping cache %s\n",
+            filename_.c_str());
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  const PixelColorBits *const colors
+    = (const PixelColorBits*)(data + colors_offset);
+  PixelDesignatorMap *const result = new PixelDesignatorMap(
+    header->width, header->height,
+    std::vector<PixelColorBits>(colors, colors + header->color_count),
+    designators, mapping, size);
+  result->CompileRuns();
+  return result;
+}
+
+void MappingCache::Store(const PixelDesignatorMap &map) const {
+  if (filename_.empty()) return;
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.description_size = Padded(description_.size() + 1);
+  header.color_count = map.all_color_bits().size();
+  header.width = map.width();
+  header.height = map.height();
+  std::vector<char> description(header.description_size, '\0');
+  memcpy(&description[0], description_.data(), description_.size());
+  const size_t count = (size_t)map.width() * map.height();
+  header.checksum = Hash(kHashStart, &description[0], description.size());
+  header.checksum = Hash(header.checksum, &map.all_color_bits()[0],
+                         header.color_count * sizeof(PixelColorBits));
+  header.checksum = Hash(header.checksum, map.designators(),
+                         count * sizeof(PixelDesignator));
+
+  // Written to a temporary file first, so that a concurrently starting
+  // process never sees half of it.
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+  const std::string tmp_name = filename_ + suffix;
+  FILE *out = fopen(tmp_name.c_str(), "wb");
+  if (out == NULL) {
+    fprintf(stderr, "FYI: Can't write pixel mapping cache %s: %s\n",
+            tmp_name.c_str(), strerror(errno));
+    return;
+  }
+  bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+  success &= fwrite(&description[0], description.size(), 1, out) == 1;
+  success &= fwrite(&map.all_color_bits()[0], sizeof(PixelColorBits),
+                    header.color_count, out) == header.color_count;
+  success &= fwrite(map.designators(), sizeof(PixelDesignator),
+                    count, out) == count;
+  success &= (fclose(out) == 0);
+  if (!success || rename(tmp_name.c_str(), filename_.c_str()) != 0) {
+    fprintf(stderr, "FYI: Can't write pixel mapping cache %s: %s\n",
+            filename_.c_str(), strerror(errno));
+    unlink(tmp_name.c_str());
+  }
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
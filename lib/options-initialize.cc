@@ -25,6 +25,7 @@
 
 #include <vector>
 
+#include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
 
 namespace rgb_matrix {
@@ -34,6 +35,7 @@ RuntimeOptions::RuntimeOptions() :
 #else
   gpio_slowdown(1),
 #endif
+  gpio_timing(NULL),
   daemon(0),            // Don't become a daemon by default.
   drop_privileges(1),    // Encourage good practice: drop privileges by default.
   do_gpio_init(true)
@@ -125,6 +127,84 @@ static bool ConsumeStringFlag(const char *flag_name,
   return true;
 }
 
+// Frame period is either a number of microseconds or "auto".
+static bool ParseFramePeriod(const char *value, int *frame_period_us) {
+  if (strcasecmp(value, "auto") == 0) {
+    *frame_period_us = -1;
+    return true;
+  }
+  char *end_value = NULL;
+  const long val = strtol(value, &end_value, 10);
+  if (!*value || *end_value || val < 0) {
+    fprintf(stderr, "Couldn't parse parameter %sframe-period=%s "
+            "(Expected microseconds or 'auto')\n", OPTION_PREFIX, value);
+    return false;
+  }
+  *frame_period_us = val;
+  return true;
+}
+
+// Refresh CPU is either a CPU number or "last".
+static bool ParseRefreshCpu(const char *value, int *cpu) {
+  if (strcasecmp(value, "last") == 0) {
+    *cpu = -1;
+    return true;
+  }
+  char *end_value = NULL;
+  const long val = strtol(value, &end_value, 10);
+  if (!*value || *end_value || val < 0) {
+    fprintf(stderr, "Couldn't parse parameter %srefresh-cpu=%s "
+            "(Expected CPU number or 'last')\n", OPTION_PREFIX, value);
+    return false;
+  }
+  *cpu = val;
+  return true;
+}
+
+// Scan mode is the number or name of a predefined scan order, or a comma
+// separated list of double rows.
+static const char *const kScanModeNames[] = {
+  "progressive", "interlaced", "bit-reversed", "interleave-4"
+};
+
+static bool ParseScanMode(const char *value, RGBMatrix::Options *mopts) {
+  if (strchr(value, ',') != NULL) {
+    mopts->scan_order = value;   // Validated once we know the rows.
+    return true;
+  }
+  const int kNumNames = sizeof(kScanModeNames) / sizeof(kScanModeNames[0]);
+  for (int i = 0; i < kNumNames; ++i) {
+    if (strcasecmp(value, kScanModeNames[i]) == 0) {
+      mopts->scan_mode = i;
+      return true;
+    }
+  }
+  char *end_value = NULL;
+  const long val = strtol(value, &end_value, 10);
+  if (!*value || *end_value) {
+    fprintf(stderr, "Couldn't parse parameter %sscan-mode=%s "
+            "(Expected number, name or comma separated rows)\n",
+            OPTION_PREFIX, value);
+    return false;
+  }
+  mopts->scan_mode = val;
+  return true;
+}
+
+// Dither policy by name or number.
+static bool ParseDitherPolicy(const char *value, int *policy) {
+  if (strcasecmp(value, "balanced") == 0 || strcmp(value, "0") == 0) {
+    *policy = RGBMatrix::Options::kDitherBalanced;
+  } else if (strcasecmp(value, "contiguous") == 0 || strcmp(value, "1") == 0) {
+    *policy = RGBMatrix::Options::kDitherContiguous;
+  } else {
+    fprintf(stderr, "Couldn't parse parameter %spwm-dither=%s "
+            "(Expected 'balanced' or 'contiguous')\n", OPTION_PREFIX, value);
+    return false;
+  }
+  return true;
+}
+
 static bool FlagInit(int &argc, char **&argv,
                      RGBMatrix::Options *mopts,
                      RuntimeOptions *ropts,
@@ -150,6 +230,9 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("pixel-mapper", it, end,
                             &mopts->pixel_mapper_config, &err))
         continue;
+      if (ConsumeStringFlag("mapping-cache", it, end,
+                            &mopts->mapping_cache_dir, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -162,8 +245,13 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeIntFlag("brightness", it, end, &mopts->brightness, &err))
         continue;
-      if (ConsumeIntFlag("scan-mode", it, end, &mopts->scan_mode, &err))
+      const char *scan_mode = NULL;
+      if (ConsumeStringFlag("scan-mode", it, end, &scan_mode, &err)) {
+        if (scan_mode != NULL && !ParseScanMode(scan_mode, mopts)) {
+          ++err;
+        }
         continue;
+      }
       if (ConsumeIntFlag("pwm-bits", it, end, &mopts->pwm_bits, &err))
         continue;
       if (ConsumeIntFlag("pwm-lsb-nanoseconds", it, end,
@@ -172,13 +260,57 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeIntFlag("pwm-dither-bits", it, end,
                          &mopts->pwm_dither_bits, &err))
         continue;
+      if (ConsumeIntFlag("pwm-slices", it, end, &mopts->pwm_slices, &err))
+        continue;
+      if (ConsumeIntFlag("idle-refresh", it, end,
+                         &mopts->idle_refresh_hz, &err))
+        continue;
+      const char *dither_policy = NULL;
+      if (ConsumeStringFlag("pwm-dither", it, end, &dither_policy, &err)) {
+        if (dither_policy != NULL
+            && !ParseDitherPolicy(dither_policy, &mopts->pwm_dither_policy)) {
+          ++err;
+        }
+        continue;
+      }
+      const char *refresh_cpu = NULL;
+      if (ConsumeStringFlag("refresh-cpu", it, end, &refresh_cpu, &err)) {
+        if (refresh_cpu != NULL
+            && !ParseRefreshCpu(refresh_cpu, &mopts->realtime.cpu)) {
+          ++err;
+        }
+        continue;
+      }
+      if (ConsumeIntFlag("refresh-priority", it, end,
+                         &mopts->realtime.priority, &err))
+        continue;
+      if (ConsumeBoolFlag("lock-memory", it, &mopts->realtime.lock_memory))
+        continue;
+      if (ConsumeBoolFlag("check-isolation", it,
+                          &mopts->realtime.check_isolation))
+        continue;
       if (ConsumeIntFlag("row-addr-type", it, end,
                          &mopts->row_address_type, &err))
         continue;
+      const char *frame_period = NULL;
+      if (ConsumeStringFlag("frame-period", it, end, &frame_period, &err)) {
+        if (frame_period != NULL
+            && !ParseFramePeriod(frame_period, &mopts->frame_period_us)) {
+          ++err;
+        }
+        continue;
+      }
       if (ConsumeBoolFlag("show-refresh", it, &mopts->show_refresh_rate))
         continue;
+      if (ConsumeStringFlag("refresh-stats-file", it, end,
+                            &mopts->refresh_stats_file, &err))
+        continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("adaptive-pwm", it, &mopts->adaptive_pwm))
+        continue;
+      if (ConsumeBoolFlag("suspend-black", it, &mopts->suspend_when_black))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -208,6 +340,8 @@ static bool FlagInit(int &argc, char **&argv,
       //-- Runtime options.
       if (ConsumeIntFlag("slowdown-gpio", it, end, &ropts->gpio_slowdown, &err))
         continue;
+      if (ConsumeStringFlag("gpio-timing", it, end, &ropts->gpio_timing, &err))
+        continue;
       if (ropts->daemon >= 0 && ConsumeBoolFlag("daemon", it, &bool_scratch)) {
         ropts->daemon = bool_scratch ? 1 : 0;
         continue;
@@ -239,6 +373,28 @@ static bool FlagInit(int &argc, char **&argv,
   return true;
 }
 
+// Parse "<setup>,<hold>,<clock-high>,<strobe>" nanoseconds.
+static bool ParseGPIOTiming(const char *spec, GPIO::Timing *timing) {
+  int *const fields[] = { &timing->data_setup_ns, &timing->data_hold_ns,
+                          &timing->clock_high_ns, &timing->strobe_ns };
+  const int kFields = sizeof(fields) / sizeof(fields[0]);
+  const char *pos = spec;
+  for (int i = 0; i < kFields; ++i) {
+    char *end;
+    const long value = strtol(pos, &end, 10);
+    if (end == pos || value < 0 || value > 100000)
+      return false;
+    *fields[i] = value;
+    if (i < kFields - 1) {
+      if (*end != ',') return false;
+      pos = end + 1;
+    } else if (*end != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool drop_privs(const char *priv_user, const char *priv_group) {
   uid_t ruid, euid, suid;
   if (getresuid(&ruid, &euid, &suid) >= 0) {
@@ -303,21 +459,38 @@ RGBMatrix *CreateMatrixFromOptions(const RGBMatrix::Options &options,
     return NULL;
   }
 
-  static GPIO io;  // This static var is a little bit icky.
-  if (runtime_options.do_gpio_init &&
-      !io.Init(runtime_options.gpio_slowdown)) {
+  GPIO::Timing gpio_timing;
+  if (runtime_options.gpio_timing != NULL &&
+      !ParseGPIOTiming(runtime_options.gpio_timing, &gpio_timing)) {
+    fprintf(stderr, "--led-gpio-timing=%s: expected four comma separated "
+            "nanosecond values <setup>,<hold>,<clock-high>,<strobe>\n",
+            runtime_options.gpio_timing);
     return NULL;
   }
 
+  // Each matrix gets its own GPIO, so that several of them can be created
+  // with different timing. It is deleted with the matrix.
+  GPIO *io = NULL;
+  if (runtime_options.do_gpio_init) {
+    io = new GPIO();
+    if (!io->Init(runtime_options.gpio_slowdown)) {
+      delete io;
+      return NULL;
+    }
+    if (runtime_options.gpio_timing != NULL)
+      io->SetTiming(gpio_timing);
+  }
+
   if (runtime_options.daemon > 0 && daemon(1, 0) != 0) {
     perror("Failed to become daemon");
   }
 
   RGBMatrix *result = new RGBMatrix(NULL, options);
+  result->owned_io_ = io;
   // Allowing daemon also means we are allowed to start the thread now.
   const bool allow_daemon = !(runtime_options.daemon < 0);
-  if (runtime_options.do_gpio_init)
-    result->SetGPIO(&io, allow_daemon);
+  if (io != NULL)
+    result->SetGPIO(io, allow_daemon);
 
   // TODO(hzeller): if we disallow daemon, then we might also disallow
   // drop privileges: we can't drop privileges until we have created the
@@ -378,42 +551,80 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: %d).\n"
           "\t--led-chain=<chained>     : Number of daisy-chained panels. "
           "(Default: %d).\n"
-          "\t--led-parallel=<parallel> : Parallel chains. range=1..3 "
+          "\t--led-parallel=<parallel> : Parallel chains. range=1..%d "
           "(Default: %d).\n"
           "\t--led-multiplexing=<0..%d> : Mux type: 0=direct; %s (Default: 0)\n"
           "\t--led-pixel-mapper        : Semicolon-separated list of pixel-mappers to arrange pixels.\n"
           "\t                            Optional params after a colon e.g. \"Snake:3;Rotate:90\"\n"
           "\t                            Available: %s. Default: \"\"\n"
+          "\t--led-mapping-cache=<dir>  : Cache the pixel mapping in this "
+          "directory.\n"
           "\t--led-pwm-bits=<1..11>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
-          "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
-          "(Default: %d).\n"
+          "\t--led-scan-mode=<0..3|name|list> : 0 = progressive; "
+          "1 = interlaced;\n"
+          "\t                            2 = bit-reversed; 3 = interleave-4; "
+          "or comma separated rows (Default: %d).\n"
           "\t--led-row-addr-type=<0..2>: 0 = default; 1 = AB-addressed panels; 2 = direct row select"
           "(Default: 0).\n"
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
+          "\t--led-refresh-stats-file=<file> : Write refresh statistics "
+          "to this file every second.\n"
           "\t--led-%sinverse             "
           ": Switch if your matrix has inverse colors %s.\n"
           "\t--led-rgb-sequence        : Switch if your matrix has led colors "
           "swapped (Default: \"RGB\")\n"
           "\t--led-pwm-lsb-nanoseconds : PWM Nanoseconds for LSB "
           "(Default: %d)\n"
-          "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
-          "(Default: 0)\n"
-          "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n",
+          "\t--led-pwm-dither-bits=<0..pwm-bits - 1> : Time dithering of "
+          "lower bits (Default: 0)\n"
+          "\t--led-pwm-dither=<balanced|contiguous> : Dither pattern "
+          "across frames (Default: %s)\n"
+          "\t--led-pwm-slices=<1..64>  : Split long bitplanes into this "
+          "many slices (Default: %d)\n"
+          "\t--led-%sadaptive-pwm        : %skip bitplanes that are dark in "
+          "the whole frame.\n"
+          "\t--led-frame-period=<usec|auto> : Fixed time per refresh cycle; "
+          "0=off (Default: %d).\n"
+          "\t--led-idle-refresh=<Hz>   : Max refresh rate with static "
+          "content; 0=off (Default: %d).\n"
+          "\t--led-%ssuspend-black       : %stop refresh while the frame is "
+          "all black.\n"
+          "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
+          "\t--led-refresh-cpu=<cpu|last> : CPU for the refresh thread "
+          "(Default: last).\n"
+          "\t--led-refresh-priority=<0..99> : Real-time priority of the "
+          "refresh thread (Default: %d).\n"
+          "\t--led-%slock-memory        : %sock memory and prefault stack "
+          "for the refresh thread.\n"
+          "\t--led-check-isolation     : Report what else runs on the "
+          "refresh CPU.\n",
           d.hardware_mapping,
-          d.rows, d.cols, d.chain_length, d.parallel,
+          d.rows, d.cols, d.chain_length, MAX_PARALLEL_CHAINS, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
           d.pwm_bits, d.brightness, d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
+          (d.pwm_dither_policy == RGBMatrix::Options::kDitherContiguous)
+          ? "contiguous" : "balanced",
+          d.pwm_slices,
+          d.adaptive_pwm ? "no-" : "", d.adaptive_pwm ? "Don't s" : "S",
+          d.frame_period_us, d.idle_refresh_hz,
+          d.suspend_when_black ? "no-" : "",
+          d.suspend_when_black ? "Don't s" : "S",
           !d.disable_hardware_pulsing ? "no-" : "",
-          !d.disable_hardware_pulsing ? "Don't u" : "U");
+          !d.disable_hardware_pulsing ? "Don't u" : "U",
+          d.realtime.priority,
+          d.realtime.lock_memory ? "no-" : "",
+          d.realtime.lock_memory ? "Don't l" : "L");
 
   fprintf(out, "\t--led-slowdown-gpio=<0..2>: "
           "Slowdown GPIO. Needed for faster Pis/slower panels "
           "(Default: %d).\n", r.gpio_slowdown);
+  fprintf(out, "\t--led-gpio-timing=<setup>,<hold>,<clock-high>,<strobe> : "
+          "Data, clock and strobe timing in nanoseconds.\n");
   if (r.daemon >= 0) {
     const bool on = (r.daemon > 0);
     fprintf(out,
@@ -464,8 +675,12 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (parallel < 1 || parallel > 3) {
-    err->append("Parallel outside usable range (1..3 allowed).\n");
+  if (parallel < 1 || parallel > MAX_PARALLEL_CHAINS) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer),
+             "Parallel outside usable range (1..%d allowed).\n",
+             MAX_PARALLEL_CHAINS);
+    err->append(buffer);
     success = false;
   }
 
@@ -479,8 +694,10 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (scan_mode < 0 || scan_mode > 1) {
-    err->append("Invalid scan mode (0 or 1 allowed).\n");
+  std::vector<int> order;
+  if (rows > 0 &&   // Otherwise already reported above.
+      !internal::Framebuffer::CreateScanOrder(rows, scan_mode, scan_order,
+                                              &order, err)) {
     success = false;
   }
 
@@ -489,8 +706,39 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (pwm_dither_bits < 0 || pwm_dither_bits > 2) {
-    err->append("Inavlid range of pwm-dither-bits (0..2 allowed).\n");
+  if (realtime.cpu < -1 || realtime.cpu >= 32) {
+    err->append("Invalid refresh CPU (0..31 or -1 for the last one).\n");
+    success = false;
+  }
+
+  if (realtime.priority < 0 || realtime.priority > 99) {
+    err->append("Invalid refresh priority (0..99 allowed).\n");
+    success = false;
+  }
+
+  if (idle_refresh_hz < 0 || idle_refresh_hz > 1000) {
+    err->append("Invalid idle refresh rate (0..1000 Hz allowed).\n");
+    success = false;
+  }
+
+  if (frame_period_us > 1000000) {
+    err->append("Frame period too long (at most 1000000 usec allowed).\n");
+    success = false;
+  }
+
+  if (pwm_dither_bits < 0 || pwm_dither_bits >= pwm_bits) {
+    err->append("Inavlid range of pwm-dither-bits (0..pwm-bits - 1 allowed).\n");
+    success = false;
+  }
+
+  if (pwm_dither_policy != kDitherBalanced
+      && pwm_dither_policy != kDitherContiguous) {
+    err->append("Invalid pwm-dither policy.\n");
+    success = false;
+  }
+
+  if (pwm_slices < 1 || pwm_slices > 64 || (pwm_slices & (pwm_slices - 1))) {
+    err->append("Invalid pwm-slices (power of two 1..64 allowed).\n");
     success = false;
   }
 
@@ -0,0 +1,40 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_RGBMATRIX_REALTIME_INTERNAL_H
+#define RPI_RGBMATRIX_REALTIME_INTERNAL_H
+
+#include <stdio.h>
+
+namespace rgb_matrix {
+namespace internal {
+
+// The last CPU of the system, where the refresh thread goes by default.
+int LastCpu();
+
+// Lock all current and future memory of the process into RAM, and keep
+// freed heap memory mapped, so that the refresh thread never waits for a
+// page fault. Needs root. Prints a note and returns false on failure.
+bool LockMemory();
+
+// Check if "cpu" is set aside for the refresh thread: isolated from the
+// scheduler (isolcpus=), without timer ticks (nohz_full=), and without
+// interrupts or other tasks that could run on it. Prints what it finds to
+// "out". Returns true if nothing competes with the refresh thread.
+bool ReportCpuIsolation(int cpu, FILE *out);
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_REALTIME_INTERNAL_H
@@ -0,0 +1,222 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "realtime-internal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace rgb_matrix {
+namespace internal {
+
+// Heap that is touched once and then kept, for allocations while running.
+static const size_t kHeapPrefaultBytes = 1 << 20;
+
+// At most this many names of competing interrupts or tasks are listed.
+static const int kMaxListed = 8;
+
+// Read a small file from /proc or /sys into "buffer". Returns false if it
+// does not exist.
+static bool ReadFile(const char *filename, char *buffer, size_t size) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  const ssize_t r = read(fd, buffer, size - 1);
+  close(fd);
+  if (r < 0) return false;
+  size_t len = r;
+  while (len > 0 && buffer[len - 1] == '\n') --len;
+  buffer[len] = '\0';
+  return true;
+}
+
+// Check if a cpu list as used by the kernel ("0-1,3") contains "cpu".
+static bool CpuListContains(const char *list, int cpu) {
+  const char *pos = list;
+  while (*pos) {
+    char *end;
+    const long first = strtol(pos, &end, 10);
+    if (end == pos) return false;
+    long last = first;
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos) return false;
+    }
+    if (cpu >= first && cpu <= last) return true;
+    if (*end != ',') break;
+    pos = end + 1;
+  }
+  return false;
+}
+
+static bool IsNumber(const char *s) {
+  if (!*s) return false;
+  for (/**/; *s; ++s) {
+    if (*s < '0' || *s > '9') return false;
+  }
+  return true;
+}
+
+static void AppendListed(int count, const char *name, std::string *list) {
+  if (count > kMaxListed) return;
+  list->append(count == 1 ? ": " : ", ");
+  list->append(count == kMaxListed ? "..." : name);
+}
+
+// Interrupts with a handler that may be delivered to "cpu".
+static int FindCompetingInterrupts(int cpu, std::string *names) {
+  DIR *const dir = opendir("/proc/irq");
+  if (dir == NULL) return 0;
+  int count = 0;
+  char path[256];
+  char buffer[256];
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!IsNumber(entry->d_name)) continue;
+    const int irq = atoi(entry->d_name);
+    snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+    if (!ReadFile(path, buffer, sizeof(buffer))) {
+      snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+      if (!ReadFile(path, buffer, sizeof(buffer))) continue;
+    }
+    if (!CpuListContains(buffer, cpu)) continue;
+
+    // Each handler of the interrupt has a directory named after it.
+    snprintf(path, sizeof(path), "/proc/irq/%d", irq);
+    DIR *const irq_dir = opendir(path);
+    if (irq_dir == NULL) continue;
+    std::string handler;
+    struct dirent *irq_entry;
+    while ((irq_entry = readdir(irq_dir)) != NULL) {
+      if (irq_entry->d_type == DT_DIR && irq_entry->d_name[0] != '.') {
+        handler = irq_entry->d_name;
+        break;
+      }
+    }
+    closedir(irq_dir);
+    if (handler.empty()) continue;  // Not in use.
+    const std::string name = std::string(entry->d_name) + "/" + handler;
+    AppendListed(++count, name.c_str(), names);
+  }
+  closedir(dir);
+  return count;
+}
+
+// Threads of other processes that may be scheduled on "cpu". Kernel threads
+// bound to it (such as ksoftirqd/<cpu>) exist on every CPU and are not
+// counted.
+static int FindCompetingTasks(int cpu, std::string *names) {
+  DIR *const dir = opendir("/proc");
+  if (dir == NULL) return 0;
+  const pid_t own_pid = getpid();
+  int count = 0;
+  char path[256];
+  char buffer[256];
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!IsNumber(entry->d_name)) continue;
+    const pid_t pid = atoi(entry->d_name);
+    if (pid == own_pid) continue;
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    const bool kernel_thread = (!ReadFile(path, buffer, sizeof(buffer))
+                                || buffer[0] == '\0');
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *const task_dir = opendir(path);
+    if (task_dir == NULL) continue;
+    struct dirent *task;
+    while ((task = readdir(task_dir)) != NULL) {
+      if (!IsNumber(task->d_name)) continue;
+      const pid_t tid = atoi(task->d_name);
+      cpu_set_t allowed;
+      if (sched_getaffinity(tid, sizeof(allowed), &allowed) != 0
+          || !CPU_ISSET(cpu, &allowed))
+        continue;
+      if (kernel_thread && CPU_COUNT(&allowed) == 1)
+        continue;
+      snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, tid);
+      if (!ReadFile(path, buffer, sizeof(buffer))) continue;
+      AppendListed(++count, buffer, names);
+    }
+    closedir(task_dir);
+  }
+  closedir(dir);
+  return count;
+}
+
+int LastCpu() {
+  const long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  return cpus > 1 ? cpus - 1 : 0;
+}
+
+bool LockMemory() {
+  // As long as we are root: no limit, so that allocations still work once
+  // privileges are dropped.
+  struct rlimit unlimited;
+  unlimited.rlim_cur = unlimited.rlim_max = RLIM_INFINITY;
+  setrlimit(RLIMIT_MEMLOCK, &unlimited);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    fprintf(stderr, "FYI: Can't lock memory: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Don't give freed memory back to the kernel, and don't use mmap() for
+  // large allocations: both would mean page faults on the next allocation.
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  char *heap = (char*) malloc(kHeapPrefaultBytes);
+  if (heap) {
+    memset(heap, 0, kHeapPrefaultBytes);
+    free(heap);
+  }
+  return true;
+}
+
+bool ReportCpuIsolation(int cpu, FILE *out) {
+  char buffer[256];
+  const bool isolated
+    = ReadFile("/sys/devices/system/cpu/isolated", buffer, sizeof(buffer))
+    && CpuListContains(buffer, cpu);
+  const bool nohz_full
+    = ReadFile("/sys/devices/system/cpu/nohz_full", buffer, sizeof(buffer))
+    && CpuListContains(buffer, cpu);
+
+  std::string irq_names;
+  const int irqs = FindCompetingInterrupts(cpu, &irq_names);
+  std::string task_names;
+  const int tasks = FindCompetingTasks(cpu, &task_names);
+
+  fprintf(out, "Refresh thread on CPU %d:\n"
+          "  isolated (isolcpus=)      : %s\n"
+          "  no timer tick (nohz_full=): %s\n"
+          "  interrupts on this CPU    : %d%s\n"
+          "  other tasks on this CPU   : %d%s\n",
+          cpu, isolated ? "yes" : "NO", nohz_full ? "yes" : "NO",
+          irqs, irq_names.c_str(), tasks, task_names.c_str());
+  return isolated && nohz_full && irqs == 0 && tasks == 0;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
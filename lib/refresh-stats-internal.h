@@ -0,0 +1,148 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_RGBMATRIX_REFRESH_STATS_INTERNAL_H
+#define RPI_RGBMATRIX_REFRESH_STATS_INTERNAL_H
+
+#include <stdint.h>
+
+#include "led-matrix.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+
+// Histogram of microsecond values with logarithmic buckets, each split into
+// kSubBuckets linear ones (like HDR histograms). So it covers the whole
+// uint32_t range in a few hundred buckets with less than 1/kSubBuckets
+// relative error.
+// Written by one thread, can be read by any thread at any time.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  void Add(uint32_t value);
+
+  uint64_t count() const;
+  uint32_t max() const;
+
+  // Value below which the fraction "p" (0..1) of the values lie. Rounded
+  // up to the end of its bucket. 0 if there are no values.
+  uint32_t Percentile(double p) const;
+
+private:
+  static const int kSubBucketBits = 3;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  static const int kBuckets = (32 - kSubBucketBits + 1) * kSubBuckets;
+
+  static int BucketFor(uint32_t value);
+  static uint32_t BucketMaxValue(int bucket);
+
+  uint64_t counts_[kBuckets];
+  uint32_t max_;
+};
+
+// Collects what the refresh thread does. All Record*() functions are called
+// from the refresh thread only; they are cheap and never block. Fill() can
+// be called from any thread.
+class RefreshStatsCollector {
+public:
+  RefreshStatsCollector();
+
+  // A refresh cycle started at "start_us" took "frame_us" in total
+  // (including padding to the frame period), of which "work_us" were spent
+  // sending the bitplanes in "planes". "frame_period_us" is what it was
+  // supposed to take at most; 0 if not limited.
+  void RecordFrame(uint32_t start_us, uint32_t frame_us, uint32_t work_us,
+                   int frame_period_us, uint16_t planes, bool idle);
+
+  // Time from handing over a new frame (or from its presentation time) until
+  // it was shown.
+  void RecordSwapLatency(uint32_t latency_us);
+
+  // Time from handing over a new frame until its first refresh cycle was
+  // completely sent to the panel.
+  void RecordPhotonLatency(uint32_t latency_us);
+
+  // A queued frame was never shown as its time was over.
+  void RecordDroppedFrame();
+
+  // Pulses of the last refresh cycle that ran late, one counter per
+  // bitplane (see Framebuffer::DumpToMatrix()).
+  void RecordLatePulses(const uint32_t *late_pulses);
+
+  void Fill(RGBMatrix::RefreshStats *stats) const;
+
+  // One refresh cycle as kept in the ring of recent frames.
+  struct FrameRecord {
+    uint32_t start_us;
+    uint32_t frame_us;
+    uint32_t work_us;
+    uint16_t planes;
+    bool idle;
+  };
+
+  // Number of frames recorded so far; the sequence number of the next one.
+  uint32_t frame_sequence() const;
+
+  // Get the frame with the given sequence number if it is still in the
+  // ring. Returns false if it has been overwritten or is not there yet.
+  bool GetFrame(uint32_t sequence, FrameRecord *record) const;
+
+private:
+  static const uint32_t kRingSize = 256;   // Power of two.
+
+  uint32_t first_start_us_;
+  FrameRecord ring_[kRingSize];
+  uint32_t frame_sequence_;
+  LatencyHistogram frame_us_;
+  LatencyHistogram swap_latency_us_;
+  LatencyHistogram photon_latency_us_;
+  uint32_t work_us_max_;
+  uint64_t frame_overruns_;
+  uint64_t dropped_frames_;
+  uint64_t late_pulses_[RGBMatrix::RefreshStats::kPlanes];
+};
+
+// Low priority thread that regularly reports the refresh statistics: prints
+// a status line to the terminal (--led-show-refresh) and/or writes them to
+// a text file (--led-refresh-stats-file), so that the real-time refresh
+// thread does not have to do any I/O.
+class RefreshStatsReporter : public Thread {
+public:
+  RefreshStatsReporter(const RefreshStatsCollector *collector,
+                       bool show_refresh, bool show_planes,
+                       const char *stats_file);
+
+  void Stop();
+  virtual void Run();
+
+private:
+  void PrintStatusLine();
+  void WriteStatsFile();
+
+  const RefreshStatsCollector *const collector_;
+  const bool show_refresh_;
+  const bool show_planes_;
+  const char *const stats_file_;
+  Mutex mutex_;
+  pthread_cond_t wakeup_;
+  bool running_;
+  uint32_t printed_sequence_;
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_REFRESH_STATS_INTERNAL_H
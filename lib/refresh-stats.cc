@@ -0,0 +1,304 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "refresh-stats-internal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+namespace rgb_matrix {
+namespace internal {
+
+// Start recording the maximum work time only after we were running for a
+// few seconds to not pick up start-up glitches.
+static const uint32_t kMaxHoldoffUs = 2000 * 1000;
+
+// How often the reporter prints the status line and writes the stats file.
+static const long kPrintIntervalMs = 100;
+static const int kWriteFileEveryPrints = 10;
+
+LatencyHistogram::LatencyHistogram() : max_(0) {
+  memset(counts_, 0, sizeof(counts_));
+}
+
+/* static */ int LatencyHistogram::BucketFor(uint32_t value) {
+  if (value < (uint32_t) kSubBuckets) return value;
+  const int msb = 31 - __builtin_clz(value);
+  const int shift = msb - kSubBucketBits;
+  return ((shift + 1) << kSubBucketBits)
+    + ((value >> shift) & (kSubBuckets - 1));
+}
+
+/* static */ uint32_t LatencyHistogram::BucketMaxValue(int bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  const int shift = (bucket >> kSubBucketBits) - 1;
+  const uint64_t first = (uint64_t)(kSubBuckets + (bucket & (kSubBuckets - 1)))
+    << shift;
+  return first + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::Add(uint32_t value) {
+  __atomic_fetch_add(&counts_[BucketFor(value)], 1, __ATOMIC_RELAXED);
+  if (value > __atomic_load_n(&max_, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&max_, value, __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t result = 0;
+  for (int i = 0; i < kBuckets; ++i)
+    result += __atomic_load_n(&counts_[i], __ATOMIC_RELAXED);
+  return result;
+}
+
+uint32_t LatencyHistogram::max() const {
+  return __atomic_load_n(&max_, __ATOMIC_RELAXED);
+}
+
+uint32_t LatencyHistogram::Percentile(double p) const {
+  uint64_t counts[kBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    counts[i] = __atomic_load_n(&counts_[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total == 0) return 0;
+  const uint64_t wanted = (uint64_t)(p * total + 0.5);
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += counts[i];
+    if (seen >= wanted && counts[i] > 0) {
+      const uint32_t bucket_max = BucketMaxValue(i);
+      return bucket_max < max() ? bucket_max : max();
+    }
+  }
+  return max();
+}
+
+RefreshStatsCollector::RefreshStatsCollector()
+  : first_start_us_(0), frame_sequence_(0), work_us_max_(0),
+    frame_overruns_(0), dropped_frames_(0) {
+  memset(ring_, 0, sizeof(ring_));
+  memset(late_pulses_, 0, sizeof(late_pulses_));
+}
+
+void RefreshStatsCollector::RecordFrame(uint32_t start_us, uint32_t frame_us,
+                                        uint32_t work_us, int frame_period_us,
+                                        uint16_t planes, bool idle) {
+  const uint32_t sequence = frame_sequence_;
+  if (sequence == 0) first_start_us_ = start_us;
+
+  FrameRecord *const record = &ring_[sequence & (kRingSize - 1)];
+  __atomic_store_n(&record->start_us, start_us, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->frame_us, frame_us, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->work_us, work_us, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->planes, planes, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->idle, idle, __ATOMIC_RELAXED);
+  __atomic_store_n(&frame_sequence_, sequence + 1, __ATOMIC_RELEASE);
+
+  frame_us_.Add(frame_us);
+  if (frame_period_us > 0 && work_us > (uint32_t)frame_period_us) {
+    __atomic_fetch_add(&frame_overruns_, 1, __ATOMIC_RELAXED);
+  }
+  if (work_us > work_us_max_ && start_us - first_start_us_ > kMaxHoldoffUs) {
+    __atomic_store_n(&work_us_max_, work_us, __ATOMIC_RELAXED);
+  }
+}
+
+void RefreshStatsCollector::RecordSwapLatency(uint32_t latency_us) {
+  swap_latency_us_.Add(latency_us);
+}
+
+void RefreshStatsCollector::RecordPhotonLatency(uint32_t latency_us) {
+  photon_latency_us_.Add(latency_us);
+}
+
+void RefreshStatsCollector::RecordDroppedFrame() {
+  __atomic_fetch_add(&dropped_frames_, 1, __ATOMIC_RELAXED);
+}
+
+void RefreshStatsCollector::RecordLatePulses(const uint32_t *late_pulses) {
+  for (int b = 0; b < RGBMatrix::RefreshStats::kPlanes; ++b) {
+    if (late_pulses[b]) {
+      __atomic_fetch_add(&late_pulses_[b], late_pulses[b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+uint32_t RefreshStatsCollector::frame_sequence() const {
+  return __atomic_load_n(&frame_sequence_, __ATOMIC_ACQUIRE);
+}
+
+bool RefreshStatsCollector::GetFrame(uint32_t sequence,
+                                     FrameRecord *result) const {
+  if (frame_sequence() - sequence - 1 >= kRingSize)
+    return false;  // Not there yet or already gone.
+  const FrameRecord *const record = &ring_[sequence & (kRingSize - 1)];
+  result->start_us = __atomic_load_n(&record->start_us, __ATOMIC_RELAXED);
+  result->frame_us = __atomic_load_n(&record->frame_us, __ATOMIC_RELAXED);
+  result->work_us = __atomic_load_n(&record->work_us, __ATOMIC_RELAXED);
+  result->planes = __atomic_load_n(&record->planes, __ATOMIC_RELAXED);
+  result->idle = __atomic_load_n(&record->idle, __ATOMIC_RELAXED);
+  // While we were reading, the refresh thread might have started to
+  // overwrite it with a new frame.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return frame_sequence() - sequence < kRingSize;
+}
+
+void RefreshStatsCollector::Fill(RGBMatrix::RefreshStats *stats) const {
+  stats->frames = frame_us_.count();
+  stats->frame_us_p50 = frame_us_.Percentile(0.5);
+  stats->frame_us_p99 = frame_us_.Percentile(0.99);
+  stats->frame_us_p999 = frame_us_.Percentile(0.999);
+  stats->frame_us_max = frame_us_.max();
+  stats->work_us_max = __atomic_load_n(&work_us_max_, __ATOMIC_RELAXED);
+  stats->frame_overruns = __atomic_load_n(&frame_overruns_, __ATOMIC_RELAXED);
+  stats->swap_latency_us_p99 = swap_latency_us_.Percentile(0.99);
+  stats->swap_latency_us_max = swap_latency_us_.max();
+  stats->photon_latency_us_p50 = photon_latency_us_.Percentile(0.5);
+  stats->photon_latency_us_p99 = photon_latency_us_.Percentile(0.99);
+  stats->photon_latency_us_max = photon_latency_us_.max();
+  stats->dropped_frames = __atomic_load_n(&dropped_frames_, __ATOMIC_RELAXED);
+  const uint32_t sequence = frame_sequence();
+  FrameRecord last;
+  stats->planes_shown = (sequence > 0 && GetFrame(sequence - 1, &last))
+    ? last.planes : 0;
+
+  stats->late_wakeups = 0;
+  for (int b = 0; b < RGBMatrix::RefreshStats::kPlanes; ++b) {
+    stats->late_pulses[b] = __atomic_load_n(&late_pulses_[b], __ATOMIC_RELAXED);
+    stats->late_wakeups += stats->late_pulses[b];
+  }
+}
+
+RefreshStatsReporter::RefreshStatsReporter(
+  const RefreshStatsCollector *collector,
+  bool show_refresh, bool show_planes, const char *stats_file)
+  : collector_(collector), show_refresh_(show_refresh),
+    show_planes_(show_planes), stats_file_(stats_file), running_(true),
+    printed_sequence_(0) {
+  pthread_cond_init(&wakeup_, NULL);
+}
+
+void RefreshStatsReporter::Stop() {
+  MutexLock l(&mutex_);
+  running_ = false;
+  pthread_cond_signal(&wakeup_);
+}
+
+void RefreshStatsReporter::Run() {
+  int prints = 0;
+  MutexLock l(&mutex_);
+  while (running_) {
+    mutex_.WaitOn(&wakeup_, kPrintIntervalMs);
+    if (!running_) break;
+    if (show_refresh_) PrintStatusLine();
+    if (stats_file_ && ++prints % kWriteFileEveryPrints == 0) {
+      WriteStatsFile();
+    }
+  }
+  if (stats_file_) WriteStatsFile();
+}
+
+// Averages over the frames since the last print.
+void RefreshStatsReporter::PrintStatusLine() {
+  const uint32_t end = collector_->frame_sequence();
+  if (end == printed_sequence_) {
+    printf("\r%8s", "(no refresh)");
+    fflush(stdout);
+    return;
+  }
+  uint64_t total_us = 0;
+  uint32_t frames = 0;
+  typedef RefreshStatsCollector::FrameRecord FrameRecord;
+  FrameRecord record;
+  FrameRecord last = FrameRecord();
+  for (uint32_t s = printed_sequence_; s != end; ++s) {
+    if (!collector_->GetFrame(s, &record)) continue;
+    total_us += record.frame_us;
+    ++frames;
+    last = record;
+  }
+  printed_sequence_ = end;
+  if (frames == 0 || total_us == 0) return;
+
+  printf("\r%6.1fHz%s", 1e6 * frames / total_us, last.idle ? " (idle)" : "");
+  if (show_planes_) {
+    // Bitplanes shown in the last frame, highest first.
+    char plane_string[17] = {0};
+    for (int b = 15, pos = 0; b >= 0; --b) {
+      if (pos || (last.planes >> b)) {
+        plane_string[pos++] = (last.planes & (1 << b)) ? '#' : '.';
+      }
+    }
+    printf(" %2d bitplanes %-11s", __builtin_popcount(last.planes),
+           plane_string);
+  }
+  RGBMatrix::RefreshStats stats;
+  collector_->Fill(&stats);
+  if (stats.work_us_max > 0) printf(" max: %uusec", stats.work_us_max);
+  if (stats.swap_latency_us_max > 0) {
+    printf(" swap latency max: %uusec", stats.swap_latency_us_max);
+  }
+  fflush(stdout);
+}
+
+// Written to a temporary file first, then renamed, so that readers never see
+// a partial file.
+void RefreshStatsReporter::WriteStatsFile() {
+  RGBMatrix::RefreshStats stats;
+  collector_->Fill(&stats);
+  const std::string tmp_file = std::string(stats_file_) + ".tmp";
+  FILE *out = fopen(tmp_file.c_str(), "w");
+  if (out == NULL) return;
+  fprintf(out,
+          "frames %llu\n"
+          "frame_us_p50 %u\n"
+          "frame_us_p99 %u\n"
+          "frame_us_p999 %u\n"
+          "frame_us_max %u\n"
+          "work_us_max %u\n"
+          "frame_overruns %llu\n"
+          "late_wakeups %llu\n"
+          "swap_latency_us_p99 %u\n"
+          "swap_latency_us_max %u\n"
+          "photon_latency_us_p50 %u\n"
+          "photon_latency_us_p99 %u\n"
+          "photon_latency_us_max %u\n"
+          "dropped_frames %llu\n"
+          "planes_shown 0x%04x\n",
+          (unsigned long long) stats.frames,
+          stats.frame_us_p50, stats.frame_us_p99, stats.frame_us_p999,
+          stats.frame_us_max, stats.work_us_max,
+          (unsigned long long) stats.frame_overruns,
+          (unsigned long long) stats.late_wakeups,
+          stats.swap_latency_us_p99, stats.swap_latency_us_max,
+          stats.photon_latency_us_p50, stats.photon_latency_us_p99,
+          stats.photon_latency_us_max,
+          (unsigned long long) stats.dropped_frames, stats.planes_shown);
+  for (int b = 0; b < RGBMatrix::RefreshStats::kPlanes; ++b) {
+    if (stats.late_pulses[b] == 0) continue;
+    fprintf(out, "late_pulses_plane%d %llu\n",
+            b, (unsigned long long) stats.late_pulses[b]);
+  }
+  if (fclose(out) == 0) {
+    rename(tmp_file.c_str(), stats_file_);
+  }
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
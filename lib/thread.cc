@@ -15,18 +15,38 @@
 
 #include "thread.h"
 
+#include <alloca.h>
 #include <sched.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 
 namespace rgb_matrix {
+// Separate function, so that the stack touched here is given back before
+// Run() is called, and then used by it.
+static void __attribute__((noinline)) PrefaultStack(size_t bytes) {
+  volatile char *stack = (volatile char*) alloca(bytes);
+  for (size_t i = 0; i < bytes; i += 1024) {
+    stack[i] = 0;
+  }
+}
+
 void *Thread::PthreadCallRun(void *tobject) {
-  reinterpret_cast<Thread*>(tobject)->Run();
+  Thread *const thread = reinterpret_cast<Thread*>(tobject);
+  if (thread->name_) {
+    char name[16];   // Limit of the kernel.
+    strncpy(name, thread->name_, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    pthread_setname_np(pthread_self(), name);
+  }
+  if (thread->stack_prefault_ > 0) {
+    PrefaultStack(thread->stack_prefault_);
+  }
+  thread->Run();
   return NULL;
 }
 
-Thread::Thread() : started_(false) {}
+Thread::Thread() : started_(false), name_(NULL), stack_prefault_(0) {}
 Thread::~Thread() {
   WaitStopped();
 }
@@ -63,8 +83,8 @@ void Thread::Start(int priority, uint32_t affinity_mask) {
       }
     }
     if ((err=pthread_setaffinity_np(thread_, sizeof(cpu_mask), &cpu_mask))) {
-      //fprintf(stderr, "FYI: Couldn't set affinity 0x%x: %s\n",
-      //        affinity_mask, strerror(err));
+      fprintf(stderr, "FYI: Couldn't set affinity 0x%x: %s\n",
+              affinity_mask, strerror(err));
     }
   }
 
@@ -0,0 +1,134 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// FillRect() and SetPixels() write whole runs of pixels that are next to
+// each other in the bitplanes. Whatever the panel, multiplexing and pixel
+// mapping, they need to end up with exactly the same bitplanes as setting
+// each of the pixels with SetPixel(), also for rectangles reaching outside
+// of the canvas.
+//
+// Does not need a Raspberry Pi. Exits with 1 if a check fails.
+
+#include "led-matrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+
+// Random rectangles drawn on each configuration.
+static const int kRectangles = 200;
+
+struct TestConfig {
+  const char *hardware_mapping;
+  int rows;
+  int cols;
+  int chain_length;
+  int parallel;
+  int multiplexing;
+  const char *pixel_mapper_config;
+  const char *led_rgb_sequence;
+  bool inverse_colors;
+};
+
+static const TestConfig kConfigs[] = {
+  { "regular",      32, 32, 2, 1, 0, "",                "RGB", false },
+  { "regular",      32, 32, 4, 3, 0, "Snake;Rotate:90", "RBG", true  },
+  { "regular",      16, 32, 3, 2, 3, "Snake",           "GBR", false },
+  { "adafruit-hat", 64, 64, 2, 1, 0, "Rotate:180",      "RGB", false },
+  { "regular",      32, 32, 2, 1, 5, "Rotate:90;Snake", "BGR", false },
+  { "regular",      64, 64, 6, 3, 0, "Rotate:270",      "RGB", false },
+  { "regular",      32, 64, 4, 1, 1, "",                "RGB", false },
+};
+
+static bool SameBitplanes(FrameCanvas *a, FrameCanvas *b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a->Serialize(&a_data, &a_len);
+  b->Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+// Returns the number of rectangles that came out differently.
+static int CheckConfig(const TestConfig &config) {
+  RGBMatrix::Options options;
+  options.hardware_mapping = config.hardware_mapping;
+  options.rows = config.rows;
+  options.cols = config.cols;
+  options.chain_length = config.chain_length;
+  options.parallel = config.parallel;
+  options.multiplexing = config.multiplexing;
+  options.pixel_mapper_config = config.pixel_mapper_config;
+  options.led_rgb_sequence = config.led_rgb_sequence;
+  options.inverse_colors = config.inverse_colors;
+  RGBMatrix *matrix = new RGBMatrix(NULL, options);
+  FrameCanvas *runs = matrix->CreateFrameCanvas();
+  FrameCanvas *pixels = matrix->CreateFrameCanvas();
+  const int width = runs->width();
+  const int height = runs->height();
+
+  int failures = 0;
+  srand(1);
+  for (int i = 0; i < kRectangles; ++i) {
+    const int x = rand() % (width + 20) - 10;
+    const int y = rand() % (height + 20) - 10;
+    const int w = rand() % (width / 2 + 10);
+    const int h = rand() % (height / 2 + 10);
+    const char *what;
+    if (i % 2 == 0) {
+      what = "FillRect";
+      const uint8_t r = rand(), g = rand(), b = rand();
+      runs->FillRect(x, y, w, h, r, g, b);
+      for (int py = y; py < y + h; ++py) {
+        for (int px = x; px < x + w; ++px) pixels->SetPixel(px, py, r, g, b);
+      }
+    } else {
+      what = "SetPixels";
+      std::vector<uint8_t> rgb(3 * w * h + 1);
+      for (size_t j = 0; j < rgb.size(); ++j) rgb[j] = rand();
+      runs->SetPixels(x, y, w, h, &rgb[0]);
+      for (int py = 0; py < h; ++py) {
+        for (int px = 0; px < w; ++px) {
+          const uint8_t *const pixel = &rgb[3 * (py * w + px)];
+          pixels->SetPixel(x + px, y + py, pixel[0], pixel[1], pixel[2]);
+        }
+      }
+    }
+    if (!SameBitplanes(runs, pixels)) {
+      fprintf(stderr, "FAIL [%s %dx%d multiplexing=%d mapper='%s' %s]: "
+              "%s(%d, %d, %d, %d)\n",
+              config.hardware_mapping, width, height, config.multiplexing,
+              config.pixel_mapper_config, config.led_rgb_sequence,
+              what, x, y, w, h);
+      ++failures;
+      break;  // All following rectangles would differ as well.
+    }
+  }
+  delete matrix;
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(kConfigs) / sizeof(kConfigs[0]); ++i) {
+    failures += CheckConfig(kConfigs[i]);
+  }
+  if (failures) return 1;
+  printf("PASS\n");
+  return 0;
+}
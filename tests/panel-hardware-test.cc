@@ -0,0 +1,137 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Two matrices with different hardware mappings refresh at the same time,
+// each on its own GPIO that writes to memory instead of the registers of
+// the Pi. Both need their own row address setter and output enable pulser:
+// only the pins of its own mapping may ever show up in the registers of a
+// matrix, and once it is switched off, its last write is its own output
+// enable pulse.
+//
+// Does not need a Raspberry Pi. Exits with 1 if a check fails.
+
+#include "led-matrix.h"
+#include "gpio.h"
+#include "gpio-internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using rgb_matrix::GPIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::internal::kGPIORegisterWords;
+using rgb_matrix::internal::UseGPIORegistersForTesting;
+
+// Word offsets in the GPIO register block.
+static const int kSetRegister = 0x1C / 4;
+static const int kClearRegister = 0x28 / 4;
+
+// How long both matrices refresh while we watch the registers.
+static const long kWatchMillis = 300;
+
+struct TestPanel {
+  const char *mapping;
+  int output_enable_pin;
+  volatile uint32_t registers[kGPIORegisterWords];
+  GPIO io;
+  RGBMatrix *matrix;
+  uint32_t seen_bits;   // Bits ever written to set or clear.
+};
+
+static int failures = 0;
+
+static void Check(bool condition, const char *what, const TestPanel &panel) {
+  if (condition) return;
+  fprintf(stderr, "FAIL [%s]: %s\n", panel.mapping, what);
+  ++failures;
+}
+
+// The pins the function select registers have as outputs.
+static uint32_t OutputPins(const volatile uint32_t *registers) {
+  uint32_t result = 0;
+  for (int pin = 0; pin < 32; ++pin) {
+    if (((registers[pin / 10] >> ((pin % 10) * 3)) & 7) == 1)
+      result |= 1u << pin;
+  }
+  return result;
+}
+
+static long MillisSince(const struct timespec &start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) * 1000
+    + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+int main(int argc, char *argv[]) {
+  TestPanel panels[2];
+  panels[0].mapping = "regular";
+  panels[0].output_enable_pin = 18;
+  panels[1].mapping = "adafruit-hat";
+  panels[1].output_enable_pin = 4;
+
+  for (int i = 0; i < 2; ++i) {
+    TestPanel &p = panels[i];
+    memset((void*) p.registers, 0, sizeof(p.registers));
+    p.seen_bits = 0;
+    UseGPIORegistersForTesting(p.registers);
+    p.io.Init(1);
+
+    RGBMatrix::Options options;
+    options.hardware_mapping = p.mapping;
+    options.rows = 16;
+    options.disable_hardware_pulsing = true;
+    options.realtime.priority = 0;   // Leave some CPU to watch.
+    p.matrix = new RGBMatrix(&p.io, options);
+    p.matrix->Fill(255, 255, 255);
+  }
+
+  const uint32_t outputs[2] = { OutputPins(panels[0].registers),
+                                OutputPins(panels[1].registers) };
+  for (int i = 0; i < 2; ++i) {
+    Check(outputs[i] & (1u << panels[i].output_enable_pin),
+          "output enable is configured as output", panels[i]);
+  }
+  Check(outputs[0] != outputs[1], "mappings use different pins", panels[0]);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (MillisSince(start) < kWatchMillis) {
+    for (int i = 0; i < 2; ++i) {
+      panels[i].seen_bits |= panels[i].registers[kSetRegister]
+        | panels[i].registers[kClearRegister];
+    }
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    TestPanel &p = panels[i];
+    Check(p.seen_bits != 0, "refresh writes to its GPIO", p);
+    Check((p.seen_bits & ~outputs[i]) == 0,
+          "only pins of its own mapping are written", p);
+
+    // Switching off shows a dark frame; the last write of that is the end
+    // of the output enable pulse of the last row.
+    delete p.matrix;
+    const uint32_t output_enable = 1u << p.output_enable_pin;
+    Check(p.registers[kSetRegister] == output_enable
+          && p.registers[kClearRegister] == output_enable,
+          "last pulse is sent by its own pulser", p);
+  }
+
+  if (failures) return 1;
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,109 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// With --led-suspend-black, the refresh stops while a cleared canvas is
+// shown. Waiting for a frame boundary without a new frame, with
+// SwapOnVSync(NULL) or the vsync eventfd, still needs to return.
+//
+// Does not need a Raspberry Pi. Exits with 1 if a check fails; a hang is
+// reported as failure after kTimeoutSeconds.
+
+#include "led-matrix.h"
+#include "gpio.h"
+#include "gpio-internal.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::internal::kGPIORegisterWords;
+using rgb_matrix::internal::UseGPIORegistersForTesting;
+
+static const int kTimeoutSeconds = 5;
+
+// Waits for frame boundaries while suspended.
+static const int kVSyncWaits = 20;
+
+static volatile uint32_t registers[kGPIORegisterWords];
+static int failures = 0;
+
+static void Check(bool condition, const char *what) {
+  if (condition) return;
+  fprintf(stderr, "FAIL: %s\n", what);
+  ++failures;
+}
+
+static void Timeout(int) {
+  static const char message[] = "FAIL: waiting for a frame boundary hangs\n";
+  if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {}
+  _exit(1);
+}
+
+static uint64_t FramesShown(RGBMatrix *matrix) {
+  RGBMatrix::RefreshStats stats;
+  matrix->GetRefreshStats(&stats);
+  return stats.frames;
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGALRM, Timeout);
+  alarm(kTimeoutSeconds);
+
+  GPIO io;
+  memset((void*) registers, 0, sizeof(registers));
+  UseGPIORegistersForTesting(registers);
+  io.Init(1);
+
+  RGBMatrix::Options options;
+  options.rows = 16;
+  options.disable_hardware_pulsing = true;
+  options.suspend_when_black = true;
+  options.realtime.priority = 0;
+  RGBMatrix *matrix = new RGBMatrix(&io, options);
+  const int vsync_fd = matrix->GetVSyncFd();
+  Check(vsync_fd >= 0, "vsync eventfd is available");
+
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  canvas->Clear();
+  canvas = matrix->SwapOnVSync(canvas);
+  usleep(100 * 1000);   // Now the refresh is suspended.
+
+  const uint64_t frames_before = FramesShown(matrix);
+  for (int i = 0; i < kVSyncWaits; ++i) {
+    matrix->SwapOnVSync(NULL);
+  }
+  if (vsync_fd >= 0) {
+    uint64_t boundaries;
+    while (read(vsync_fd, &boundaries, sizeof(boundaries)) > 0) {}
+    struct pollfd pfd = { vsync_fd, POLLIN, 0 };
+    Check(poll(&pfd, 1, 1000) == 1, "vsync eventfd becomes readable");
+  }
+  // A refresh cycle takes a few milliseconds here; so if it did not stop,
+  // there would be many more.
+  Check(FramesShown(matrix) - frames_before < kVSyncWaits / 2,
+        "refresh is suspended while waiting");
+
+  delete matrix;
+
+  if (failures) return 1;
+  printf("PASS\n");
+  return 0;
+}
@@ -18,10 +18,12 @@ extern "C" {
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "led-matrix.h"
@@ -58,6 +60,45 @@ void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas) {
   }
 }
 
+// Frames are decoded ahead into this many canvases and queued with the time
+// they should be shown.
+static const int kDecodeAheadFrames = 8;
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Block until the refresh thread takes the next frame from the queue or
+// passes a refresh boundary: only then queue slots and completed frames can
+// become available. Notifications since the last call are not lost, as the
+// eventfd keeps counting until it is read.
+static void WaitForRefresh(int vsync_fd) {
+  struct pollfd pfd = { vsync_fd, POLLIN, 0 };
+  if (poll(&pfd, 1, 100) > 0) {
+    uint64_t count;
+    if (read(vsync_fd, &count, sizeof(count)) < 0) {
+      // Someone else reset it; nothing to do.
+    }
+  }
+}
+
+// A canvas to decode the next frame into: one the matrix is done with, a new
+// one while we have less than kDecodeAheadFrames, or wait until one is done.
+static FrameCanvas *GetFreeCanvas(RGBMatrix *matrix, int vsync_fd,
+                                  int *canvas_count) {
+  for (;;) {
+    FrameCanvas *result = matrix->GetCompletedFrame();
+    if (result != NULL) return result;
+    if (*canvas_count < kDecodeAheadFrames) {
+      ++*canvas_count;
+      return matrix->CreateFrameCanvas();
+    }
+    WaitForRefresh(vsync_fd);
+  }
+}
+
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s [options] <video>\n", progname);
   fprintf(stderr, "Options:\n"
@@ -236,6 +277,10 @@ int main(int argc, char *argv[]) {
   signal(SIGINT, InterruptHandler);
 
   const int frame_wait_micros = 1e6 / fps;
+  const int64_t frame_wait_nanos = 1e9 / fps;
+  int64_t presentation_time_ns = -1;
+  int canvas_count = 1;
+  const int vsync_fd = stream_writer ? -1 : matrix->GetVSyncFd();
   while (!interrupt_received && av_read_frame(pFormatCtx, &packet) >= 0) {
     // Is this a packet from the video stream?
     if (packet.stream_index==videoStream) {
@@ -254,16 +299,31 @@ int main(int argc, char *argv[]) {
         if (stream_writer) {
           stream_writer->Stream(*offscreen_canvas, frame_wait_micros);
         } else {
-          offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas);
+          // Show the first frame right away, then the refresh thread keeps
+          // the pace given by the presentation times.
+          if (presentation_time_ns < 0) presentation_time_ns = MonotonicNanos();
+          while (!matrix->QueueFrame(offscreen_canvas, presentation_time_ns)
+                 && !interrupt_received) {
+            WaitForRefresh(vsync_fd);
+          }
+          presentation_time_ns += frame_wait_nanos;
+          offscreen_canvas = GetFreeCanvas(matrix, vsync_fd, &canvas_count);
         }
       }
-      if (!stream_writer) usleep(frame_wait_micros);
     }
 
     // Free the packet that was allocated by av_read_frame
     av_free_packet(&packet);
   }
 
+  if (!interrupt_received && presentation_time_ns > 0) {
+    // Let the queued frames play out.
+    struct timespec end;
+    end.tv_sec = presentation_time_ns / 1000000000;
+    end.tv_nsec = presentation_time_ns % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL);
+  }
+
   if (interrupt_received) {
     // Feedback for Ctrl-C, but most importantly, force a newline
     // at the output, so that commandline-shell editing is not messed up.